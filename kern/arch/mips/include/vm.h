@@ -125,14 +125,24 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * One shootdown carries up to TLBSHOOTDOWN_PAGES pages of one address
+ * space, identified by its TLB address space ID and the ID generation
+ * it belongs to; no pages means all of the address space's entries.
+ * A kernel one drops every kseg2 entry instead. The sender waits on
+ * ts_wait until every target has done it.
  */
 
+#define TLBSHOOTDOWN_PAGES 16
+
+struct tlbshootdown_wait;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	bool ts_kernel;				/* vmalloc's entries */
+	unsigned ts_asid;
+	unsigned ts_gen;
+	unsigned ts_npages;			/* 0 for the whole space */
+	vaddr_t ts_pages[TLBSHOOTDOWN_PAGES];
+	struct tlbshootdown_wait *ts_wait;
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -143,6 +143,44 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* vm calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits wide and a3 can't hold
+			 * it on its own, so it goes on the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS_madvise:
+		err = sys_madvise((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
+	    case SYS_mincore:
+		err = sys_mincore((userptr_t)tf->tf_a0, tf->tf_a1,
+				  (userptr_t)tf->tf_a2);
+		break;
+
+
 	    /* file calls */
 
 	    case SYS_open:
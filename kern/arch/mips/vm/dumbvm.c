@@ -147,8 +147,128 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+void
+frame_set_subpage(vaddr_t addr, int blktype)
+{
+	/* no frame table to record it in; kfree looks the page up */
+	(void)addr;
+	(void)blktype;
+}
+
+int
+frame_subpage(vaddr_t addr)
+{
+	(void)addr;
+	return -1;
+}
+
 #endif
 
+void
+vm_tlbsweep(void)
+{
+	/* dumbvm has no page replacement to collect references for. */
+}
+
+bool
+vm_idle(void)
+{
+	/* dumbvm does no background work in idle time. */
+	return false;
+}
+
+void *
+vmalloc(size_t size)
+{
+	/* dumbvm leaves kseg2 unmapped; kmalloc just fails. */
+	(void)size;
+	return NULL;
+}
+
+void
+vfree(void *ptr)
+{
+	(void)ptr;
+	panic("vfree: dumbvm never hands out vmalloc areas\n");
+}
+
+bool
+vmalloc_contains(const void *ptr)
+{
+	(void)ptr;
+	return false;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap region. */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	       size_t filesize, int readable, int writeable, int executable,
+	       struct vnode *vn, off_t offset)
+{
+	/* dumbvm loads everything; load_elf never asks for this. */
+	(void)as;
+	(void)vaddr;
+	(void)sz;
+	(void)filesize;
+	(void)readable;
+	(void)writeable;
+	(void)executable;
+	(void)vn;
+	(void)offset;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, size_t length, int permission,
+	struct vnode *vn, off_t offset, vaddr_t *addr)
+{
+	/* dumbvm has no room for mappings. */
+	(void)as;
+	(void)length;
+	(void)permission;
+	(void)vn;
+	(void)offset;
+	(void)addr;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	(void)as;
+	(void)addr;
+	return ENOSYS;
+}
+
+int
+vm_madvise(struct addrspace *as, vaddr_t start, vaddr_t end, int advice)
+{
+	(void)as;
+	(void)start;
+	(void)end;
+	(void)advice;
+	return ENOSYS;
+}
+
+int
+vm_mincore(struct addrspace *as, vaddr_t start, vaddr_t end, userptr_t vec)
+{
+	(void)as;
+	(void)start;
+	(void)end;
+	(void)vec;
+	return ENOSYS;
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
@@ -28,10 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <current.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <objcache.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -40,20 +45,66 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 
 
+/*
+ * A frame table entry. Fields changed under different locks are kept
+ * in different words (or bytes), so that one CPU's read-modify-write
+ * of a bitfield can't undo another's store:
+ *
+ *    allocated .. order     - allocation state. Under
+ *                             frame_table_spinlock while the frame is
+ *                             on the buddy lists, under fc_lock while
+ *                             it is in a frame cache, and otherwise
+ *                             changed only by whoever allocates or
+ *                             frees it.
+ *    refcount, as, vaddr    - sharing and reverse map of an allocated
+ *                             frame, under its frame lock. The
+ *                             allocator sets them before anyone else
+ *                             can reach the frame.
+ *    next_free, prev_free   - buddy list links, frame_table_spinlock.
+ *    referenced, subpage    - a byte each, stored without locking.
+ */
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
         unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned block_head:1; /* the frame heads a free buddy block */
+        unsigned order:5;     /* log2 of that block's size in frames */
+        uint32_t refcount;    /* number of users sharing the frame (COW) */
+        struct addrspace *as; /* owning address space of a user frame */
+        vaddr_t vaddr;        /* user page the frame is mapped at */
+        uint32_t next_free;   /* free list links, NO_FRAME terminated */
+        uint32_t prev_free;
+        uint8_t referenced;   /* page was used since the clock hand passed */
+        uint8_t subpage;      /* kmalloc block type + 1 of a heap page */
 } ft_entry_t;
 
 
 static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
+static uint32_t victim_hand; /* where the next eviction scan starts */
 
 #define PAGE_BITS 12
 #define TRUE 1
 #define FALSE 0
 
+/* Frame 0 holds the exception vectors and is never free */
+#define NO_FRAME 0
+
+/* Largest buddy block is 2^BUDDY_MAX_ORDER frames (4M) */
+#define BUDDY_MAX_ORDER 10
+
+static uint32_t free_head[BUDDY_MAX_ORDER + 1]; /* free blocks of each order */
+static uint32_t nfree_frames; /* total free frames over all orders */
+
+/* buddy statistics, protected by frame_table_spinlock */
+static unsigned nfree_blocks[BUDDY_MAX_ORDER + 1]; /* blocks on each list */
+static unsigned buddy_allocs[BUDDY_MAX_ORDER + 1]; /* allocations by order */
+static unsigned buddy_splits;
+static unsigned buddy_merges;
+static unsigned buddy_failures;
+
+static void buddy_free_range(uint32_t i, uint32_t npages);
+
 
 /* frame_table protected by spinlock (interrupt disabling on
  * uniprocessor) as this implementation does not block.
@@ -61,6 +112,44 @@ static uint32_t last_frame;
 
 static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Frame locks, hashed by frame number, for the sharing and reverse
+ * map fields of allocated frames. Page faults on different CPUs share,
+ * claim and free their frames under these instead of meeting on
+ * frame_table_spinlock. A frame lock may be taken with
+ * frame_table_spinlock held, never the other way round, and is never
+ * held while taking a frame cache's fc_lock.
+ */
+#define FRAME_NLOCKS 64
+static struct spinlock frame_locks[FRAME_NLOCKS];
+#define FRAME_LOCK(i) (&frame_locks[(i) % FRAME_NLOCKS])
+
+/*
+ * Per-CPU frame caches. Each CPU keeps a small stack of free single
+ * frames so alloc_kpages(1)/free_kpages on one CPU don't take the
+ * global frame_table_spinlock. Frames move between a cache and the
+ * buddy lists FRAME_CACHE_BATCH at a time.
+ *
+ * A cached frame is on no buddy list, has allocated, block_head and
+ * refcount clear and no owner. Its allocation state, and that of a
+ * single frame being freed into the cache, belong to the cache and
+ * are changed under fc_lock only; the buddy lists only touch free
+ * block heads.
+ */
+#define FRAME_CACHE_SIZE 32   /* frames a CPU may hold */
+#define FRAME_CACHE_BATCH 16  /* frames moved to or from the buddy lists */
+
+struct frame_cache {
+        struct spinlock fc_lock;
+        unsigned fc_count;    /* frames in fc_frames */
+        uint32_t fc_frames[FRAME_CACHE_SIZE];
+        unsigned fc_hits;     /* allocations served from the cache */
+        unsigned fc_refills;  /* batches taken from the buddy lists */
+        unsigned fc_drains;   /* batches given back */
+};
+
+static struct frame_cache frame_caches[MAXCPUS];
+
 /*
  * Called very early in system boot to figure out how much physical
  * RAM is available.
@@ -130,6 +219,11 @@ ram_bootstrap(void)
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
                 frame_table[i].not_last = FALSE;
+                frame_table[i].block_head = FALSE;
+                frame_table[i].refcount = 1;
+                frame_table[i].referenced = FALSE;
+                frame_table[i].subpage = 0;
+                frame_table[i].as = NULL;
         }                                            
         
         /* 
@@ -140,8 +234,27 @@ ram_bootstrap(void)
         
         for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
                 frame_table[i].allocated = FALSE;
+                frame_table[i].block_head = FALSE;
+                frame_table[i].refcount = 0;
+                frame_table[i].referenced = FALSE;
+                frame_table[i].subpage = 0;
+                frame_table[i].as = NULL;
+        }
+        victim_hand = first_frame;
+
+        for (i = 0; i < FRAME_NLOCKS; i++) {
+                spinlock_init(&frame_locks[i]);
+        }
+
+        for (i = 0; i < MAXCPUS; i++) {
+                spinlock_init(&frame_caches[i].fc_lock);
         }
 
+        /* hand the free range to the buddy allocator */
+        spinlock_acquire(&frame_table_spinlock);
+        buddy_free_range(first_frame, last_frame - first_frame);
+        spinlock_release(&frame_table_spinlock);
+
         
 }
 
@@ -189,90 +302,289 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Binary buddy allocator.
+ *
+ * Free frames are kept in aligned blocks of 2^order frames, one
+ * doubly linked list per order threaded through the frame table. The
+ * first frame of each free block is marked block_head and records the
+ * order. A block's buddy is the block of the same order whose index
+ * differs only in bit 'order'; when both are free they are merged.
+ *
+ * An allocation of npages takes a block of the smallest order that
+ * fits, splitting larger blocks as needed, and gives the frames past
+ * npages straight back. The frames handed out are chained with
+ * not_last as before so free_frames knows how many to release.
+ *
+ * Single pages come off the order 0 list in constant time; the worst
+ * case for any request is BUDDY_MAX_ORDER splits or merges.
  */
 
+static void freelist_remove(uint32_t i, unsigned order)
+{
+        uint32_t prev = frame_table[i].prev_free;
+        uint32_t next = frame_table[i].next_free;
+
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+        KASSERT(frame_table[i].block_head == TRUE);
+        KASSERT(frame_table[i].order == order);
+
+        if (prev == NO_FRAME) {
+                KASSERT(free_head[order] == i);
+                free_head[order] = next;
+        }
+        else {
+                frame_table[prev].next_free = next;
+        }
+        if (next != NO_FRAME) {
+                frame_table[next].prev_free = prev;
+        }
+        frame_table[i].block_head = FALSE;
+        nfree_blocks[order]--;
+        nfree_frames -= 1U << order;
+}
+
+static void freelist_push(uint32_t i, unsigned order)
+{
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+
+        frame_table[i].block_head = TRUE;
+        frame_table[i].order = order;
+        frame_table[i].prev_free = NO_FRAME;
+        frame_table[i].next_free = free_head[order];
+        if (free_head[order] != NO_FRAME) {
+                frame_table[free_head[order]].prev_free = i;
+        }
+        free_head[order] = i;
+        nfree_blocks[order]++;
+        nfree_frames += 1U << order;
+}
 
-static paddr_t alloc_one_frame(unsigned int npages)
+/*
+ * Free the block of 2^order frames at i, merging it with its buddy as
+ * long as the buddy is also free.
+ */
+static void buddy_free_block(uint32_t i, unsigned order)
 {
-        unsigned int i;
+        uint32_t buddy;
+
+        while (order < BUDDY_MAX_ORDER) {
+                buddy = i ^ (1U << order);
+                if (buddy < first_frame ||
+                    buddy + (1U << order) > last_frame ||
+                    frame_table[buddy].block_head == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
+                }
+                freelist_remove(buddy, order);
+                buddy_merges++;
+                if (buddy < i) {
+                        i = buddy;
+                }
+                order++;
+        }
+        freelist_push(i, order);
+}
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+/*
+ * Free NPAGES frames starting at i by splitting the range into the
+ * largest aligned blocks that fit.
+ */
+static void buddy_free_range(uint32_t i, uint32_t npages)
+{
+        unsigned order;
+
+        while (npages > 0) {
+                order = 0;
+                while (order < BUDDY_MAX_ORDER &&
+                       (i & (1U << order)) == 0 &&
+                       (2U << order) <= npages) {
+                        order++;
+                }
+                buddy_free_block(i, order);
+                i += 1U << order;
+                npages -= 1U << order;
+        }
+}
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+/*
+ * Take a free block of 2^order frames off the buddy lists, splitting a
+ * larger one if need be. Returns NO_FRAME if there is none.
+ */
+static uint32_t buddy_take(unsigned order)
+{
+        unsigned k;
+        uint32_t i;
 
-                        spinlock_release(&frame_table_spinlock);
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
 
-                        return (paddr_t) (i << PAGE_BITS);
+        /* find the smallest free block that fits */
+        for (k = order; k <= BUDDY_MAX_ORDER; k++) {
+                if (free_head[k] != NO_FRAME) {
+                        break;
                 }
         }
-        
-        /* Did not find an unallocated frame :-( */
+        if (k > BUDDY_MAX_ORDER) {
+                /* Did not find a large enough free block :-( */
+                buddy_failures++;
+                return NO_FRAME;
+        }
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+        i = free_head[k];
+        freelist_remove(i, k);
+
+        /* split it down, putting the upper halves back */
+        while (k > order) {
+                k--;
+                freelist_push(i + (1U << k), k);
+                buddy_splits++;
+        }
+        buddy_allocs[order]++;
+        return i;
 }
 
-static paddr_t alloc_multiple_frames(unsigned int npages)
+static paddr_t alloc_frames(unsigned int npages)
 {
-        unsigned int i,j;
+        unsigned order;
+        uint32_t i, j;
 
+        KASSERT(npages > 0);
 
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+        for (order = 0; (1U << order) < npages; order++) {
+                if (order == BUDDY_MAX_ORDER) {
+                        /* larger than any block we keep */
+                        return (paddr_t) 0;
+                }
+        }
 
         spinlock_acquire(&frame_table_spinlock);
 
-        i = first_frame; j = 0;
+        i = buddy_take(order);
+        if (i == NO_FRAME) {
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) 0;
+        }
 
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
-                }
-                else {
-                        j = j + 1; /* increment count of free frames */
-                }
+        /* give back what we don't need of the block */
+        if (npages < (1U << order)) {
+                buddy_free_range(i + npages, (1U << order) - npages);
+        }
+
+        for (j = i; j < i + npages; j++) {
+                KASSERT(frame_table[j].allocated == FALSE);
+                frame_table[j].allocated = TRUE; /* mark frame allocated */
+                frame_table[j].not_last = TRUE;  /* as a contiguous block */
+                frame_table[j].referenced = TRUE;
+                KASSERT(frame_table[j].as == NULL);
+        }
+        frame_table[j - 1].not_last = FALSE;
+        frame_table[i].refcount = 1;
+
+        spinlock_release(&frame_table_spinlock);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+/*
+ * The calling CPU's frame cache, or NULL early in boot before there
+ * is a curcpu.
+ */
+static struct frame_cache *frame_cache_get(void)
+{
+        if (curthread == NULL) {
+                return NULL;
+        }
+        KASSERT(curcpu->c_number < MAXCPUS);
+        return &frame_caches[curcpu->c_number];
+}
+
+/* Give N frames from the top of a cache back to the buddy lists */
+static void frame_cache_drain(struct frame_cache *fc, unsigned n)
+{
+        KASSERT(spinlock_do_i_hold(&fc->fc_lock));
+        KASSERT(n <= fc->fc_count);
+
+        spinlock_acquire(&frame_table_spinlock);
+        while (n > 0) {
+                buddy_free_block(fc->fc_frames[--fc->fc_count], 0);
+                n--;
         }
+        spinlock_release(&frame_table_spinlock);
+        fc->fc_drains++;
+}
+
+/*
+ * Empty every CPU's cache, so that frames held there can be used for
+ * a request the buddy lists could not satisfy.
+ */
+static void frame_cache_drain_all(void)
+{
+        unsigned i;
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
+        for (i = 0; i < MAXCPUS; i++) {
+                spinlock_acquire(&frame_caches[i].fc_lock);
+                if (frame_caches[i].fc_count > 0) {
+                        frame_cache_drain(&frame_caches[i],
+                                          frame_caches[i].fc_count);
                 }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+                spinlock_release(&frame_caches[i].fc_lock);
+        }
+}
+
+static paddr_t alloc_cached_frame(struct frame_cache *fc)
+{
+        uint32_t i;
 
+        spinlock_acquire(&fc->fc_lock);
+        if (fc->fc_count == 0) {
+                spinlock_acquire(&frame_table_spinlock);
+                while (fc->fc_count < FRAME_CACHE_BATCH) {
+                        i = buddy_take(0);
+                        if (i == NO_FRAME) {
+                                break;
+                        }
+                        fc->fc_frames[fc->fc_count++] = i;
+                }
                 spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
+                if (fc->fc_count == 0) {
+                        spinlock_release(&fc->fc_lock);
+                        return (paddr_t) 0;
+                }
+                fc->fc_refills++;
+        }
+        else {
+                fc->fc_hits++;
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+        i = fc->fc_frames[--fc->fc_count];
+        KASSERT(frame_table[i].allocated == FALSE);
+        KASSERT(frame_table[i].as == NULL);
+        frame_table[i].allocated = TRUE;
+        frame_table[i].not_last = FALSE;
+        frame_table[i].referenced = TRUE;
+        frame_table[i].refcount = 1;
+        spinlock_release(&fc->fc_lock);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+/* Called once the last reference to frame i is gone */
+static void free_cached_frame(struct frame_cache *fc, uint32_t i)
+{
+        spinlock_acquire(&fc->fc_lock);
+        frame_table[i].allocated = FALSE;
+        if (fc->fc_count == FRAME_CACHE_SIZE) {
+                frame_cache_drain(fc, FRAME_CACHE_BATCH);
+        }
+        fc->fc_frames[fc->fc_count++] = i;
+        spinlock_release(&fc->fc_lock);
 }
 
 static void free_frames(vaddr_t vaddr)
 {
+        struct frame_cache *fc;
         paddr_t paddr;
-        uint32_t i;
+        uint32_t i, j;
+        bool single;
 
         KASSERT(vaddr != (vaddr_t) NULL);
 
@@ -280,18 +592,46 @@ static void free_frames(vaddr_t vaddr)
 
         i = paddr >> PAGE_BITS;
 
-        spinlock_acquire(&frame_table_spinlock);
-
+        spinlock_acquire(FRAME_LOCK(i));
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+
+        /* a shared frame is only released by its last user */
+        KASSERT(frame_table[i].refcount > 0);
+        frame_table[i].refcount--;
+        if (frame_table[i].refcount > 0) {
+                spinlock_release(FRAME_LOCK(i));
+                return;
+        }
+        frame_table[i].as = NULL;
+        single = frame_table[i].not_last == FALSE;
+        spinlock_release(FRAME_LOCK(i));
+
+        /* nobody else can reach the frames now */
+
+        /* a single frame goes to this CPU's cache */
+        fc = frame_cache_get();
+        if (fc != NULL && single) {
+                free_cached_frame(fc, i);
+                return;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        /* otherwise mark the whole allocation free */
+        j = i;
+        while (1) {
+                KASSERT(frame_table[j].allocated == TRUE);
+                frame_table[j].allocated = FALSE;
+                frame_table[j].as = NULL;
+                if (frame_table[j].not_last == FALSE) {
+                        break;
                 }
+                j++;
         }
+        buddy_free_range(i, j - i + 1);
+
         spinlock_release(&frame_table_spinlock);
 }
         
@@ -299,12 +639,26 @@ static void free_frames(vaddr_t vaddr)
 vaddr_t
 alloc_kpages(unsigned npages)
 {
+        struct frame_cache *fc;
         paddr_t paddr;
-        if (npages > 1 ) {
-                paddr = alloc_multiple_frames(npages);
+
+        fc = frame_cache_get();
+        if (npages == 1 && fc != NULL) {
+                paddr = alloc_cached_frame(fc);
         }
         else {
-                paddr = alloc_one_frame(npages);
+                paddr = alloc_frames(npages);
+        }
+        if (paddr == 0) {
+                /* the frames may be sitting in other CPUs' caches */
+                frame_cache_drain_all();
+                paddr = alloc_frames(npages);
+        }
+        if (paddr == 0 && fc != NULL && curcpu->c_spinlocks == 0 &&
+            objcache_reclaim() > 0) {
+                /* or held by cached objects, thread stacks above all */
+                frame_cache_drain_all();
+                paddr = alloc_frames(npages);
         }
         
 	if (paddr == 0) {
@@ -319,3 +673,350 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * Frame sharing for copy-on-write. A frame handed out by
+ * alloc_kpages starts with one reference; each extra page table
+ * mapping takes another with frame_share. free_kpages drops a
+ * reference and only releases the frame when the last one goes.
+ */
+void
+frame_share(paddr_t paddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(FRAME_LOCK(i));
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        frame_table[i].refcount++;
+        /* a shared frame has no single owner to unmap it from */
+        frame_table[i].as = NULL;
+        spinlock_release(FRAME_LOCK(i));
+}
+
+unsigned
+frame_refcount(paddr_t paddr)
+{
+        uint32_t i;
+        unsigned refcount;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(FRAME_LOCK(i));
+        refcount = frame_table[i].refcount;
+        spinlock_release(FRAME_LOCK(i));
+
+        return refcount;
+}
+
+
+/*
+ * Report the number of frames managed and how many are free, counting
+ * frames held in the per-CPU caches as free.
+ *
+ * This is an unlocked snapshot of the per-CPU cache counts and the
+ * buddy lists' count, which is plenty for deciding when to start
+ * evicting. Most allocations and frees only change their own CPU's
+ * count, and the buddy count moves a batch at a time, so page faults
+ * checking the kernel reserve don't take frame_table_spinlock.
+ */
+void
+frame_counts(unsigned *nframes, unsigned *nfree)
+{
+        unsigned i, ncached;
+
+        ncached = 0;
+        for (i = 0; i < MAXCPUS; i++) {
+                ncached += frame_caches[i].fc_count;
+        }
+
+        *nframes = last_frame - first_frame;
+        *nfree = nfree_frames + ncached;
+}
+
+/*
+ * Reverse map for paging. A user frame records the address space and
+ * page it is mapped at so it can be unmapped when chosen for
+ * eviction. Frames with no owner (kernel frames, and user frames
+ * shared copy-on-write) are never chosen. The caller is expected to
+ * hold the page table lock of the address space the frame is (or
+ * was) mapped in, which eviction takes to check the owner's entry.
+ */
+void
+frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(FRAME_LOCK(i));
+        KASSERT(frame_table[i].allocated == TRUE);
+        frame_table[i].as = as;
+        frame_table[i].vaddr = vaddr;
+        spinlock_release(FRAME_LOCK(i));
+}
+
+/*
+ * Block types of kernel heap pages. kmalloc records which of its
+ * block sizes a page it carves up holds (-1 when it gives the page
+ * back), so that kfree can find the size of a block without looking
+ * the page up under its global lock. The entry only changes while
+ * kmalloc has no blocks out on the page, so a caller holding one can
+ * read it without locking.
+ */
+void
+frame_set_subpage(vaddr_t vaddr, int blktype)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(vaddr) >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+        KASSERT(blktype >= -1 && blktype < 15);
+        KASSERT(frame_table[i].allocated == TRUE);
+
+        frame_table[i].subpage = blktype + 1;
+}
+
+int
+frame_subpage(vaddr_t vaddr)
+{
+        uint32_t i;
+
+        if (frame_table == NULL) {
+                return -1;
+        }
+        i = KVADDR_TO_PADDR(vaddr) >> PAGE_BITS;
+        if (i < first_frame || i >= last_frame) {
+                return -1;
+        }
+        return (int) frame_table[i].subpage - 1;
+}
+
+/*
+ * Page replacement policies.
+ *
+ * A policy says where the eviction scan over the frame table starts
+ * and whether an evictable frame should be passed over this time. The
+ * scan takes the first frame that is evictable and not passed over,
+ * and leaves victim_hand just after it.
+ *
+ *    fifo   - round-robin from the hand. Frames are reused roughly in
+ *             the order they were handed out.
+ *    clock  - second chance. A frame whose reference bit is set has it
+ *             cleared and is passed over. vm_fault sets the bit when
+ *             it loads a TLB entry for the frame, and vm_tlbsweep
+ *             throws away TLB entries periodically so pages still in
+ *             use fault again and get marked.
+ *    random - start the scan at a random frame.
+ */
+struct frame_policy {
+        const char *fp_name;
+        uint32_t (*fp_start)(void);
+        bool (*fp_skip)(ft_entry_t *fte);
+};
+
+static uint32_t hand_start(void)
+{
+        return victim_hand;
+}
+
+static uint32_t random_start(void)
+{
+        return first_frame + random() % (last_frame - first_frame);
+}
+
+static bool never_skip(ft_entry_t *fte)
+{
+        (void)fte;
+        return false;
+}
+
+/*
+ * A frame_reference racing with this may be lost, costing the page its
+ * second chance once; the reference bit is only ever a hint.
+ */
+static bool second_chance(ft_entry_t *fte)
+{
+        if (fte->referenced == TRUE) {
+                fte->referenced = FALSE;
+                return true;
+        }
+        return false;
+}
+
+static const struct frame_policy frame_policies[] = {
+        { "fifo",   hand_start,   never_skip },
+        { "clock",  hand_start,   second_chance },
+        { "random", random_start, never_skip },
+};
+
+static const struct frame_policy *frame_policy = &frame_policies[1];
+
+/* eviction statistics, protected by frame_table_spinlock */
+static unsigned frame_victims;    /* frames chosen */
+static unsigned frame_scanned;    /* frames looked at to choose them */
+static unsigned frame_secondchances; /* frames passed over */
+
+/*
+ * Select the replacement policy by name. Returns EINVAL if there is
+ * no such policy.
+ */
+int
+frame_set_policy(const char *name)
+{
+        unsigned i;
+
+        for (i = 0; i < ARRAYCOUNT(frame_policies); i++) {
+                if (!strcmp(name, frame_policies[i].fp_name)) {
+                        spinlock_acquire(&frame_table_spinlock);
+                        frame_policy = &frame_policies[i];
+                        frame_victims = 0;
+                        frame_scanned = 0;
+                        frame_secondchances = 0;
+                        spinlock_release(&frame_table_spinlock);
+                        return 0;
+                }
+        }
+        return EINVAL;
+}
+
+/*
+ * Mark a user frame as recently used, for the clock policy. AS and
+ * VADDR, unless AS is NULL, say where the frame is mapped: a frame
+ * with no owner and a single reference, such as the last mapping of
+ * one shared copy-on-write after the other sharers went away, takes
+ * them as its owner so it can be evicted again.
+ *
+ * This runs on every TLB refill, so the reference bit is a plain byte
+ * store and the frame lock is only taken to claim an owner.
+ */
+void
+frame_reference(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        if (frame_table[i].referenced == FALSE) {
+                frame_table[i].referenced = TRUE;
+        }
+        if (as == NULL || frame_table[i].as != NULL) {
+                return;
+        }
+        spinlock_acquire(FRAME_LOCK(i));
+        if (frame_table[i].as == NULL && frame_table[i].refcount == 1) {
+                frame_table[i].as = as;
+                frame_table[i].vaddr = vaddr;
+        }
+        spinlock_release(FRAME_LOCK(i));
+}
+
+/*
+ * Pick a user frame to evict using the current policy. The scan goes
+ * round the frame table at most twice, so that the clock policy finds
+ * a frame even if every reference bit was set. Returns ENOMEM if no
+ * frame in memory can be evicted.
+ */
+int
+frame_choose_victim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr)
+{
+        uint32_t i, n;
+        bool found;
+
+        spinlock_acquire(&frame_table_spinlock);
+        i = frame_policy->fp_start();
+        for (n = 0; n < 2 * (last_frame - first_frame); n++) {
+                frame_scanned++;
+                /* look without the frame lock first, most frames aren't */
+                if (frame_table[i].allocated == TRUE &&
+                    frame_table[i].as != NULL) {
+                        spinlock_acquire(FRAME_LOCK(i));
+                        found = frame_table[i].refcount == 1 &&
+                                frame_table[i].as != NULL;
+                        if (found && frame_policy->fp_skip(&frame_table[i])) {
+                                frame_secondchances++;
+                                found = false;
+                        }
+                        if (found) {
+                                *paddr = (paddr_t) (i << PAGE_BITS);
+                                *as = frame_table[i].as;
+                                *vaddr = frame_table[i].vaddr;
+                        }
+                        spinlock_release(FRAME_LOCK(i));
+                        if (found) {
+                                frame_victims++;
+                                victim_hand = i + 1;
+                                if (victim_hand == last_frame) {
+                                        victim_hand = first_frame;
+                                }
+                                spinlock_release(&frame_table_spinlock);
+                                return 0;
+                        }
+                }
+                i++;
+                if (i == last_frame) {
+                        i = first_frame;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+        return ENOMEM;
+}
+
+/*
+ * Print the replacement policy, buddy allocator and frame cache
+ * statistics.
+ */
+void
+frame_printstats(void)
+{
+        unsigned victims, scanned, secondchances;
+        unsigned blocks[BUDDY_MAX_ORDER + 1], allocs[BUDDY_MAX_ORDER + 1];
+        unsigned splits, merges, failures, nfree;
+        unsigned count, hits, refills, drains;
+        struct frame_cache *fc;
+        const char *name;
+        unsigned k;
+
+        spinlock_acquire(&frame_table_spinlock);
+        name = frame_policy->fp_name;
+        victims = frame_victims;
+        scanned = frame_scanned;
+        secondchances = frame_secondchances;
+        for (k = 0; k <= BUDDY_MAX_ORDER; k++) {
+                blocks[k] = nfree_blocks[k];
+                allocs[k] = buddy_allocs[k];
+        }
+        splits = buddy_splits;
+        merges = buddy_merges;
+        failures = buddy_failures;
+        nfree = nfree_frames;
+        spinlock_release(&frame_table_spinlock);
+
+        kprintf("Replacement policy %s: %u victims, %u frames scanned, "
+                "%u second chances\n", name, victims, scanned, secondchances);
+        kprintf("Buddy allocator: %u free frames, %u splits, %u merges, "
+                "%u failures\n", nfree, splits, merges, failures);
+        for (k = 0; k < MAXCPUS; k++) {
+                fc = &frame_caches[k];
+                spinlock_acquire(&fc->fc_lock);
+                count = fc->fc_count;
+                hits = fc->fc_hits;
+                refills = fc->fc_refills;
+                drains = fc->fc_drains;
+                spinlock_release(&fc->fc_lock);
+                if (hits + refills + drains == 0) {
+                        continue;
+                }
+                kprintf("  cpu%u cache: %u frames, %u hits, %u refills, "
+                        "%u drains\n", k, count, hits, refills, drains);
+        }
+        for (k = 0; k <= BUDDY_MAX_ORDER; k++) {
+                kprintf("  order %2u (%4u pages): %5u free blocks, "
+                        "%7u allocations\n", k, 1U << k, blocks[k], allocs[k]);
+        }
+}
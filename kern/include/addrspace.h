@@ -33,34 +33,89 @@
 // First level 2^11 entries and 2^9 for second level
 #define PT_FIRST_SIZE 2048
 #define PT_SECOND_SIZE 512
-#define NUM_STACK 16
+// The stack starts out this many pages and grows down on demand, up to
+// the address space's stack_limit (STACK_LIMIT unless changed), always
+// leaving an unmapped guard page above the region below it
+#define NUM_STACK 1
+#define STACK_LIMIT (8 * 1024 * 1024)
 #define READ 0x4
 #define WRITE 0x2
 #define EXECUTE 0x1
+// WRITE was added by as_prepare_load and goes again in as_complete_load
+#define LOADWRITE 0x8
+// Made by as_mmap, so munmap may remove it
+#define MAPPED 0x10
+// File region whose pages are private copies read in on first touch
+#define PRIVATE 0x20
 #define PAGE_SIZE 4096
+// Page table entries hold the frame with TLBLO_DIRTY/TLBLO_VALID and
+// software bits below them:
+//   PTE_WRITE      the page may be written without being copied first; a
+//                  frame shared copy-on-write is entered without it
+//   PTE_REFERENCED the page has been touched since it was mapped
+//   PTE_DIRTY      the page has been written since it was read in; a
+//                  PTE_FILE page that isn't can be read from its file again
+//   PTE_FILE       the page was read from a PRIVATE region's file
+// Pages are entered without TLBLO_DIRTY until they are first written.
+#define PTE_WRITE 0x2
+#define PTE_REFERENCED 0x4
+#define PTE_DIRTY 0x8
+#define PTE_FILE 0x10
+#define PTE_FRAME(pte) ((pte) & PAGE_FRAME)
+// The part of an entry that goes in the TLB
+#define PTE_TLBLO(pte) ((pte) & (PAGE_FRAME | TLBLO_DIRTY | TLBLO_VALID))
+// A page that was paged out keeps its swap slot in the frame bits and
+// has PTE_SWAPPED set instead of TLBLO_VALID. PTE_TRANSIT goes with it
+// while the page is being written to or read from swap.
+#define PTE_SWAPPED 0x1
+#define PTE_TRANSIT 0x20
+#define PTE_SWAPSLOT(pte) ((pte) >> 12)
+#define MKPTE_SWAP(slot) (((slot) << 12) | PTE_SWAPPED)
 /*
  * Address space structure and operations.
  */
 
 
 #include <vm.h>
+#include <kern/mman.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pagetable;
 
 /*
 *   The region for the VM address spaces where
-*   base: is the start of the region
-*   size: is the size of the region
+*   base: is the start of the region, page aligned
+*   size: is the size of the region in bytes, a whole number of pages
 *   permission: is permission access the regions can do
-*   next: is a pointer to the next region
+*   prefilled/zeroahead: fault-around statistics, the TLB entries loaded
+*       for pages other than the faulting one and the pages allocated
+*       ahead of a sequential scan
+*   vnode/offset: for a mapped file, the file (which the region holds a
+*       reference to) and the file offset of base; vnode is NULL otherwise
+*   filestart/fileend: for a PRIVATE region, the addresses that are read
+*       from the file; the rest of the region is zero filled
+*   advice: the last MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL given
+*       for it with madvise
 */
 struct region{
     vaddr_t base;
     int permission;
     size_t size;
-    struct region *next;
+    unsigned prefilled;
+    unsigned zeroahead;
+    struct vnode *vnode;
+    off_t offset;
+    vaddr_t filestart;
+    vaddr_t fileend;
+    int advice;
 };
+// File offset of address ADDR in a file region
+#define REGION_FILEOFF(r, addr) ((r)->offset + (off_t)((addr) - (r)->base))
+// Whether the pages of a region belong to the page cache
+#define REGION_CACHED(r) ((r)->vnode != NULL && !((r)->permission & PRIVATE))
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -79,14 +134,39 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        paddr_t **pagetable;
-        struct region *region_head;
+        struct pagetable *pagetable;
+        /* protects the page table, taken after the paging lock */
+        struct lock *pt_lock;
+        /* pages with PTE_TRANSIT set, under both locks */
+        unsigned transit;
+        /* regions sorted by base; they never overlap */
+        struct region **regions;
+        unsigned nregions;
+        unsigned maxregions;    /* allocated size of regions[] */
+        struct region *last_region; /* last one lookup_region found */
+        vaddr_t last_fault;     /* page of the last fault, for fault-around */
+        /* heap region, set up by as_complete_load, and the break */
+        struct region *heap;
+        vaddr_t heap_end;
+        /* stack region, set up by as_define_stack, and its size limit */
+        struct region *stack;
+        size_t stack_limit;
+        /* TLB address space ID, valid while asid_gen is current */
+        unsigned asid;
+        unsigned asid_gen;
+        /* CPUs that ran it with that ID, which may hold its entries */
+        uint32_t cpus;  /* one bit per CPU, so MAXCPUS <= 32 */
+        /* each CPU's c_tlbswept when it last switched away from it */
+        unsigned tlbswept[MAXCPUS];
 #endif
 };
 
 /*
  * Functions in addrspace.c:
  *
+ *    as_bootstrap - set up the cache regions are allocated from.
+ *                Called by vm_bootstrap.
+ *
  *    as_create - create a new empty address space. You need to make
  *                sure this gets called in all the right places. You
  *                may find you want to change the argument list. May
@@ -120,11 +200,30 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The region grows down when faults hit below it.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, handing back
+ *                the old end. Memory is only allocated on first touch.
+ *
+ *    as_define_file - like as_define_region for a segment whose first
+ *                FILESIZE bytes come from VN at OFFSET. Nothing is read
+ *                until the pages are touched. Read-only segments with
+ *                no zero fill that line up with the file page for page
+ *                share the page cache's frames; other pages are read
+ *                into private frames.
+ *
+ *    as_mmap   - map LENGTH bytes of VN starting at OFFSET (page
+ *                aligned) somewhere below the stack, handing back the
+ *                address chosen. PERMISSION is made of READ and WRITE.
+ *                Pages are shared with every other mapping of the file.
+ *
+ *    as_munmap - remove the mapping as_mmap handed back ADDR for.
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void); // Jackie (DONE)
 int               as_copy(struct addrspace *src, struct addrspace **ret); // Izaac (DONE)
 void              as_activate(void); //Together (DONE)
@@ -139,6 +238,18 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as); // Jackie (DONE)
 int               as_complete_load(struct addrspace *as); // Jackie (DONE)
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr); // Jackie (DONE)
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_define_file(struct addrspace *as,
+                                 vaddr_t vaddr, size_t sz, size_t filesize,
+                                 int readable,
+                                 int writeable,
+                                 int executable,
+                                 struct vnode *vn, off_t offset);
+int               as_mmap(struct addrspace *as, size_t length,
+                          int permission, struct vnode *vn, off_t offset,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr);
 
 
 /*
@@ -150,5 +261,84 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
+/*
+ * Functions in vm.c
+ *    vm_paging_lock/unlock - take or drop the paging lock, which
+ *               serializes allocating user frames against eviction,
+ *               and then AS's page table lock (unless AS is NULL).
+ *               "The paging lock held for AS" below means both.
+ *    vm_wait_transit - wait until no page of AS is on its way to or
+ *               from swap. Call with the paging lock held for AS;
+ *               it is dropped while waiting.
+ *    vm_pagein - bring the swapped out page PAGE of AS back into
+ *               memory. Call with the paging lock held for AS, which
+ *               is dropped while it reads. Hands back the new page
+ *               table entry.
+ *    lookup_region - find the region containing ADDR, or NULL.
+ *    vm_tlb_activate - switch this CPU's TLB to AS, assigning it an
+ *               address space ID if it has none in this generation.
+ *    vm_tlb_release - forget AS before it is freed.
+ *    vm_tlb_flush_as - drop AS's entries from every CPU's TLB. Call
+ *               with the paging lock held for AS.
+ *    vm_tlb_invalidate - drop the entries for PAGE of AS from every
+ *               CPU's TLB. Call with the paging lock held for AS.
+ *    vm_unmap - free the pages of AS from START up to END, which lie in
+ *               REGION, and drop their TLB entries. Call with the paging
+ *               lock held for AS.
+ *    vm_getpage - allocate a frame, paging something out if need be.
+ *               Call without the paging lock.
+ *    vm_pte_share/vm_pte_release - take or drop the reference a page
+ *               table entry holds to its frame. Call with the paging
+ *               lock held for the entry's address space.
+ *    vm_madvise - apply MADV_* ADVICE to the pages of AS from START up
+ *               to END, which must all be in regions. Access pattern
+ *               advice applies to the whole of each region touched.
+ *    vm_mincore - copy out to VEC a byte of MINCORE_* bits for each
+ *               page of AS from START up to END.
+ */
+
+void vm_paging_lock(struct addrspace *as);
+void vm_paging_unlock(struct addrspace *as);
+void vm_wait_transit(struct addrspace *as);
+int vm_pagein(vaddr_t page, struct addrspace *as, paddr_t *ret);
+struct region *lookup_region(vaddr_t addr, struct addrspace *as);
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_release(struct addrspace *as);
+void vm_tlb_flush_as(struct addrspace *as);
+void vm_tlb_invalidate(vaddr_t page, struct addrspace *as);
+void vm_unmap(struct addrspace *as, struct region *region,
+              vaddr_t start, vaddr_t end);
+vaddr_t vm_getpage(void);
+void vm_pte_share(paddr_t pte);
+void vm_pte_release(paddr_t pte);
+int vm_madvise(struct addrspace *as, vaddr_t start, vaddr_t end, int advice);
+int vm_mincore(struct addrspace *as, vaddr_t start, vaddr_t end,
+               userptr_t vec);
+
+/*
+ * Functions in pagetable.c (all but pt_printstats with the address
+ * space's page table lock held, or on one no one else can see yet)
+ *    pt_create/pt_destroy - make and free an empty page table.
+ *               pt_destroy doesn't touch the frames entries refer to.
+ *    lookup_pt/insert_pt - read and write the page table entry for
+ *               PAGE; 0 means no entry. insert_pt may fail with ENOMEM.
+ *    pt_foreach - call FN on every non-zero entry, stopping early if it
+ *               returns an error. FN may change the entry it was given
+ *               with insert_pt, but must not add entries to that table.
+ *    pt_reclaim - free the memory held for the cleared entries of pages
+ *               from START up to END. Not from inside pt_foreach.
+ *    pt_printstats - print page table memory use and lookup cost.
+ */
+
+typedef int (*pt_visit_fn)(vaddr_t page, paddr_t pte, void *data);
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+paddr_t lookup_pt(vaddr_t page, struct addrspace *as);
+int insert_pt(vaddr_t page, paddr_t pte, struct addrspace *as);
+int pt_foreach(struct addrspace *as, pt_visit_fn fn, void *data);
+void pt_reclaim(struct addrspace *as, vaddr_t start, vaddr_t end);
+void pt_printstats(void);
+
 
 #endif /* _ADDRSPACE_H_ */
@@ -35,6 +35,7 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct addrspace;
 
 /*
  * Per-cpu structure
@@ -61,6 +62,16 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_tlbpid;		/* Address space ID loaded in TLB */
+	unsigned c_tlbgen;		/* ASID generation of TLB contents */
+	unsigned c_tlbkept;		/* as_activate calls that did nothing */
+
+	/*
+	 * Accessed by other cpus, to see whose TLB entries may be here.
+	 * Protected by the VM system's ASID lock.
+	 */
+	struct addrspace *c_tlbas;	/* Address space c_tlbpid is for */
+	unsigned c_tlbswept;		/* TLB slots vm_tlbsweep has cleared */
 
 	/*
 	 * Accessed by other cpus.
@@ -109,6 +120,13 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+
+/*
+ * cpu_count returns the number of cpus, and cpu_get cpu number
+ * NUMBER (less than cpu_count()).
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
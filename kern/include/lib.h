@@ -123,15 +123,22 @@ uint32_t random(void);
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
- * kheap_nextgeneration, dump, and dumpall do nothing unless heap
+ * kheap_bootstrap turns on the per-CPU caches once the CPU structures
+ * exist. kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kprof_setrate restarts the allocation-site profiler, sampling 1 in
+ * RATE kmallocs (0 turns it off); kprof_printstats prints what it has.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+void kheap_bootstrap(void);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kprof_setrate(unsigned rate);
+void kprof_printstats(void);
 
 /*
  * C string functions.
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * An object cache hands out objects of one type that stay constructed
+ * while they sit in the cache: the constructor sets up the parts that
+ * are expensive to make and the same in every object (locks, CVs,
+ * stacks), runs once when an object is first made, and the destructor
+ * only runs when the cache gives the object's memory back to kmalloc.
+ * Code using a cache must hand objects back in their constructed
+ * state, and initializes the rest of each object itself.
+ *
+ * Functions:
+ *     objcache_create  - make a cache of objects of SIZE bytes. CTOR
+ *                        (may be NULL) returns 0 or an error code; DTOR
+ *                        (may be NULL) undoes it.
+ *     objcache_destroy - destroy a cache. Its objects must all have
+ *                        been freed.
+ *     objcache_alloc   - get a constructed object, or NULL if out of
+ *                        memory.
+ *     objcache_free    - give an object back.
+ *     objcache_reclaim - destruct every cached object and give the
+ *                        memory back, for when memory runs out.
+ *                        Returns how many objects went. Call with no
+ *                        spinlocks held.
+ *     objcache_printstats - print statistics for every cache.
+ */
+
+struct objcache;
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+unsigned objcache_reclaim(void);
+void objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
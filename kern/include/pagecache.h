@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for mapped files.
+ *
+ * Each page of a file that is mapped somewhere is read into a frame
+ * once, keyed by vnode and file offset, and every mapping of it uses
+ * that frame. The cache keeps a reference to the vnode and the frame
+ * while anything maps the page. When the last mapping goes away the
+ * page is written back if it was written to and freed by the next
+ * pagecache_reap().
+ *
+ * Functions:
+ *     pagecache_bootstrap - set up the cache.
+ *     pagecache_get  - hand back the frame holding the page of VN at
+ *                      OFFSET (page aligned), reading it in if it isn't
+ *                      cached, and take a mapping reference to it. The
+ *                      part past the end of the file reads as zeros.
+ *                      May sleep; don't hold the paging lock.
+ *     pagecache_ref  - take another mapping reference to a page that is
+ *                      already mapped, e.g. when fork copies the mapping.
+ *     pagecache_put  - drop a mapping reference. DIRTY says the mapping
+ *                      may have written to the page. Doesn't do I/O, so
+ *                      it can be called with the paging lock held.
+ *     pagecache_reap - write back and free the pages nothing maps any
+ *                      more. Call without the paging lock.
+ *     pagecache_printstats - print cache statistics.
+ */
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+int  pagecache_get(struct vnode *vn, off_t offset, paddr_t *frame);
+void pagecache_ref(struct vnode *vn, off_t offset);
+void pagecache_put(struct vnode *vn, off_t offset, bool dirty);
+void pagecache_reap(void);
+void pagecache_printstats(void);
+
+
+#endif /* _PAGECACHE_H_ */
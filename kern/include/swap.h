@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the VM system.
+ *
+ * Swap lives on a raw disk device handed back by vfs_swapon(). The
+ * device is carved into page-sized slots tracked in a bitmap. Going
+ * through the raw device rather than a file on a mounted filesystem
+ * avoids taking filesystem locks while the VM system is paging.
+ *
+ * Functions:
+ *     swap_bootstrap - attach SWAP_DEVICE. If it can't be attached
+ *                      the system runs without paging.
+ *     swap_enabled   - return true if there is swap to page to.
+ *     swap_alloc     - reserve a free slot. Returns ENOSPC if swap
+ *                      is full.
+ *     swap_free      - release a slot.
+ *     swap_out       - write the page at kernel address KVADDR to SLOT.
+ *     swap_in        - read SLOT into the page at kernel address KVADDR.
+ */
+
+#define SWAP_DEVICE "lhd0"
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int  swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int  swap_out(unsigned slot, vaddr_t kvaddr);
+int  swap_in(unsigned slot, vaddr_t kvaddr);
+
+
+#endif /* _SWAP_H_ */
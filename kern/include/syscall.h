@@ -92,4 +92,10 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval);
+int sys_munmap(userptr_t addr);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec);
+
 #endif /* _SYSCALL_H_ */
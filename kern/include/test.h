@@ -96,6 +96,9 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int framebench(int, char **);
+int buddytest(int, char **);
+int objcachetest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
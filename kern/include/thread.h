@@ -158,6 +158,12 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Return true if no other thread is waiting to run on this cpu.
+ * Interrupts need not be disabled.
+ */
+bool thread_cpu_idle(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -54,8 +54,56 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Number of frames managed by alloc_kpages, and how many are free */
+void frame_counts(unsigned *nframes, unsigned *nfree);
+
+/* Reference counting on shared (copy-on-write) user frames */
+void frame_share(paddr_t paddr);
+unsigned frame_refcount(paddr_t paddr);
+
+/* Reverse map from user frames to their owner, for paging */
+struct addrspace;
+void frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+int frame_choose_victim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr);
+
+/* Block type (or -1) of kernel heap pages carved up by kmalloc */
+void frame_set_subpage(vaddr_t vaddr, int blktype);
+int frame_subpage(vaddr_t vaddr);
+
+/* Page replacement policy ("fifo", "clock" or "random") and frame stats */
+int frame_set_policy(const char *name);
+void frame_reference(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void frame_printstats(void);
+
+/* Set the fault-around window in pages (a power of two, 1 turns it off) */
+int vm_set_faultaround(unsigned npages);
+
+/* Drop a slice of this CPU's TLB so in-use pages refault and get marked */
+void vm_tlbsweep(void);
+
+/* Idle loop hook; true if it made a thread runnable on this CPU */
+bool vm_idle(void);
+
+/* Print paging statistics */
+void vm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Drop kseg2 entries from the TLBs of the CPUs in a mask */
+void vm_tlb_flush_kernel(uint32_t cpus);
+
+/*
+ * Large kernel allocations out of single frames, mapped in kseg2
+ * through a kernel page table. kmalloc falls back on these when it
+ * can't find contiguous pages.
+ */
+void vmalloc_bootstrap(void);
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+bool vmalloc_contains(const void *ptr);
+int vmalloc_fault(int faulttype, vaddr_t faultaddress);
+void vmalloc_printstats(void);
+
 
 #endif /* _VM_H_ */
@@ -45,8 +45,11 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <objcache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -467,6 +470,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	objcache_printstats();
 
 	return 0;
 }
@@ -500,6 +504,62 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprof_printstats();
+	}
+	else if (nargs == 2) {
+		kprof_setrate(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: kprof [rate]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy fifo|clock|random\n");
+		return EINVAL;
+	}
+
+	return frame_set_policy(args[1]);
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: faultaround npages\n");
+		return EINVAL;
+	}
+
+	return vm_set_faultaround(atoi(args[1]));
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +626,9 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[fb]  Frame allocator benchmark     ",
+	"[bt]  Buddy allocator test          ",
+	"[oc]  Object cache test             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -606,6 +669,12 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[kprof] kmalloc allocation sites    ",
+#if !OPT_DUMBVM
+	"[vm] VM paging stats                ",
+	"[vmpolicy] Set page replacement     ",
+	"[faultaround] Set fault-around pages",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +726,12 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "kprof",      cmd_kprof },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "vmpolicy",   cmd_vmpolicy },
+	{ "faultaround", cmd_faultaround },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +742,9 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "fb",		framebench },
+	{ "bt",		buddytest },
+	{ "oc",		objcachetest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * With our VM system the segments are not loaded here at all. Each is
+ * defined with as_define_file instead, and its pages are read from the
+ * executable (or shared through the page cache) when first touched.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +53,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -59,6 +61,14 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
+
+/* dumbvm can't page segments in, they have to be loaded up front */
+#if OPT_DUMBVM
+#define LOAD_ON_DEMAND 0
+#else
+#define LOAD_ON_DEMAND 1
+#endif
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -155,6 +165,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
+	struct stat st;
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
@@ -202,6 +213,15 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	/*
+	 * Segments that get paged in are only read later, so check now
+	 * that they are all there.
+	 */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
 	/*
 	 * Go through the list of segments and set up the address space.
 	 *
@@ -243,11 +263,26 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		if ((off_t)ph.p_offset + ph.p_filesz > st.st_size) {
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		if (LOAD_ON_DEMAND) {
+			result = as_define_file(as, ph.p_vaddr, ph.p_memsz,
+						ph.p_filesz,
+						ph.p_flags & PF_R,
+						ph.p_flags & PF_W,
+						ph.p_flags & PF_X,
+						v, ph.p_offset);
+		}
+		else {
+			result = as_define_region(as,
+						  ph.p_vaddr, ph.p_memsz,
+						  ph.p_flags & PF_R,
+						  ph.p_flags & PF_W,
+						  ph.p_flags & PF_X);
+		}
 		if (result) {
 			return result;
 		}
@@ -259,10 +294,10 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now actually load each segment, unless they get paged in.
 	 */
 
-	for (i=0; i<eh.e_phnum; i++) {
+	for (i=0; !LOAD_ON_DEMAND && i<eh.e_phnum; i++) {
 		off_t offset = eh.e_phoff + i*eh.e_phentsize;
 		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
 
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <addrspace.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+/* mmap protection bits, as in userland <unistd.h> */
+#define PROT_READ	1
+#define PROT_WRITE	2
+
+/*
+ * Virtual memory system calls.
+ */
+
+/*
+ * sbrk: move the end of the heap. Returns the old end.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LENGTH bytes of the open file FD, from OFFSET on, at an
+ * address of the kernel's choosing. The mapping is shared: writes go
+ * back to the file and every process mapping the file sees them.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	int permission;
+	vaddr_t addr;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	if (length == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* the file has to be open for whatever the mapping allows */
+	if (((prot & PROT_READ) && file->of_accmode == O_WRONLY) ||
+	    ((prot & PROT_WRITE) && file->of_accmode == O_RDONLY)) {
+		result = EACCES;
+		goto out;
+	}
+
+	result = VOP_MMAP(file->of_vnode);
+	if (result) {
+		goto out;
+	}
+
+	permission = 0;
+	if (prot & PROT_READ) {
+		permission |= READ;
+	}
+	if (prot & PROT_WRITE) {
+		permission |= WRITE;
+	}
+	/* the mapping keeps its own reference to the vnode */
+	result = as_mmap(as, length, permission, file->of_vnode, offset,
+			 &addr);
+	if (result) {
+		goto out;
+	}
+	*retval = (int)addr;
+
+ out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * munmap: remove a mapping made by mmap, writing back what was
+ * written to it once nothing else maps the same pages.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr);
+}
+
+/*
+ * Turn ADDR and LEN into a page range, as madvise and mincore take
+ * them. ADDR must be page aligned.
+ */
+static
+int
+vm_syscall_range(userptr_t addr, size_t len, vaddr_t *start, vaddr_t *end)
+{
+	*start = (vaddr_t)addr;
+	if (*start % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	*end = *start + ROUNDUP(len, PAGE_SIZE);
+	if (*end < *start || *end > USERSPACETOP) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * madvise: tell the VM system how a range of memory will be used.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	struct addrspace *as;
+	vaddr_t start, end;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = vm_syscall_range(addr, len, &start, &end);
+	if (result) {
+		return result;
+	}
+	return vm_madvise(as, start, end, advice);
+}
+
+/*
+ * mincore: report which pages of a range are in memory, one byte of
+ * MINCORE_* bits per page.
+ */
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+	struct addrspace *as;
+	vaddr_t start, end;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = vm_syscall_range(addr, len, &start, &end);
+	if (result) {
+		return result;
+	}
+	return vm_mincore(as, start, end, vec);
+}
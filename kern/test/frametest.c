@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the frame allocator.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <objcache.h>
+#include <test.h>
+
+#include "opt-unsw.h"
+
+/*
+ * Fill physical memory to increasing levels of occupancy with single
+ * pages and at each level time FB_NTRIES alloc_kpages/free_kpages
+ * pairs. Single pages, the allocation every first-touch page fault
+ * makes, are mostly served from the per-CPU frame caches; pairs of
+ * FB_MULTI pages always go to the buddy lists, splitting and merging
+ * blocks, and show what the allocator itself costs. Neither should
+ * grow as memory fills up.
+ *
+ * Pages held to reach an occupancy level are chained through their
+ * first word so the benchmark needs no memory of its own.
+ */
+
+#define FB_NTRIES 1000		/* so total microseconds == ns per pair */
+#define FB_MULTI 4		/* pages in a buddy allocation */
+
+static const unsigned fb_levels[] = { 10, 25, 50, 75, 90, 95 };
+
+/*
+ * Time FB_NTRIES allocations of NPAGES pages, each freed straight
+ * away, into USECS. Returns false if memory ran out.
+ */
+static
+bool
+framebench_pairs(unsigned npages, unsigned long *usecs)
+{
+	struct timespec start, end;
+	vaddr_t page;
+	unsigned j;
+
+	gettime(&start);
+	for (j=0; j<FB_NTRIES; j++) {
+		page = alloc_kpages(npages);
+		if (page == 0) {
+			return false;
+		}
+		free_kpages(page);
+	}
+	gettime(&end);
+	timespec_sub(&end, &start, &end);
+
+	*usecs = end.tv_sec * 1000000UL + end.tv_nsec / 1000;
+	return true;
+}
+
+int
+framebench(int nargs, char **args)
+{
+#if OPT_UNSW
+	unsigned nframes, nfree, level, i;
+	vaddr_t held, page;
+	unsigned long single, multi;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting frame allocator benchmark...\n");
+
+	held = 0;
+	for (i=0; i<ARRAYCOUNT(fb_levels); i++) {
+		level = fb_levels[i];
+
+		frame_counts(&nframes, &nfree);
+		while ((nframes - nfree) * 100 < nframes * level) {
+			page = alloc_kpages(1);
+			if (page == 0) {
+				break;
+			}
+			*(vaddr_t *)page = held;
+			held = page;
+			frame_counts(&nframes, &nfree);
+		}
+
+		if (!framebench_pairs(1, &single) ||
+		    !framebench_pairs(FB_MULTI, &multi)) {
+			kprintf("framebench: out of memory at %u%%\n",
+				level);
+			goto done;
+		}
+		kprintf("%3u%% occupied (%u/%u frames): %lu ns per "
+			"alloc/free, %lu ns per %u page alloc/free\n",
+			level, nframes - nfree, nframes, single, multi,
+			FB_MULTI);
+	}
+
+ done:
+	while (held != 0) {
+		page = held;
+		held = *(vaddr_t *)page;
+		free_kpages(page);
+	}
+	kprintf("Frame allocator benchmark done\n");
+#else
+	(void)nargs;
+	(void)args;
+
+	kprintf("framebench: needs the unsw frame allocator\n");
+#endif
+	return 0;
+}
+
+/*
+ * Check that the buddy allocator coalesces. Allocate every free frame
+ * as single pages, free them again in an interleaved order, and then
+ * ask for a large multi-page block: it must succeed and
+ * the free count must come back to where it started.
+ *
+ * Running out makes alloc_kpages empty the object caches, which would
+ * free more than the test took, so that is done before counting.
+ */
+
+#define BT_NPAGES 64		/* a 256K block */
+
+int
+buddytest(int nargs, char **args)
+{
+#if OPT_UNSW
+	unsigned nframes, nfree, startfree, i;
+	vaddr_t held, odd, page, block;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting buddy allocator test...\n");
+
+	objcache_reclaim();
+	frame_counts(&nframes, &startfree);
+
+	/* take every frame as a single page */
+	held = 0;
+	while ((page = alloc_kpages(1)) != 0) {
+		*(vaddr_t *)page = held;
+		held = page;
+	}
+
+	/* give back every other page, then the rest */
+	odd = 0;
+	i = 0;
+	while (held != 0) {
+		page = held;
+		held = *(vaddr_t *)page;
+		if (i++ % 2) {
+			*(vaddr_t *)page = odd;
+			odd = page;
+		}
+		else {
+			free_kpages(page);
+		}
+	}
+	while (odd != 0) {
+		page = odd;
+		odd = *(vaddr_t *)page;
+		free_kpages(page);
+	}
+
+	frame_counts(&nframes, &nfree);
+	if (nfree != startfree) {
+		panic("buddytest: %u frames free after test, %u before\n",
+		      nfree, startfree);
+	}
+
+	/* memory should be one piece again */
+	block = alloc_kpages(BT_NPAGES);
+	if (block == 0) {
+		panic("buddytest: no %u page block after freeing "
+		      "everything\n", BT_NPAGES);
+	}
+	free_kpages(block);
+
+	frame_counts(&nframes, &nfree);
+	if (nfree != startfree) {
+		panic("buddytest: %u frames free after test, %u before\n",
+		      nfree, startfree);
+	}
+	kprintf("Buddy allocator test done\n");
+#else
+	(void)nargs;
+	(void)args;
+
+	kprintf("buddytest: needs the unsw frame allocator\n");
+#endif
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Test for object caches.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <objcache.h>
+#include <test.h>
+
+/*
+ * Objects remember whether they were constructed; the counters say
+ * how often the constructor and destructor ran. A freed object must
+ * come back out of the cache without being constructed again.
+ */
+
+#define OCT_NOBJS 8
+#define OCT_MAGIC 0x0bc0ffee
+
+struct octobj {
+	uint32_t o_magic;	/* set by the constructor */
+	unsigned o_value;	/* set by the user */
+	char o_pad[100];
+};
+
+static unsigned oct_ctors, oct_dtors;
+
+static
+int
+oct_ctor(void *obj)
+{
+	struct octobj *o = obj;
+
+	o->o_magic = OCT_MAGIC;
+	oct_ctors++;
+	return 0;
+}
+
+static
+void
+oct_dtor(void *obj)
+{
+	struct octobj *o = obj;
+
+	KASSERT(o->o_magic == OCT_MAGIC);
+	o->o_magic = 0;
+	oct_dtors++;
+}
+
+int
+objcachetest(int nargs, char **args)
+{
+	struct objcache *oc;
+	struct octobj *objs[OCT_NOBJS];
+	unsigned i, made;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+	oct_ctors = oct_dtors = 0;
+
+	oc = objcache_create("octest", sizeof(struct octobj),
+			     oct_ctor, oct_dtor);
+	if (oc == NULL) {
+		kprintf("objcachetest: out of memory\n");
+		return ENOMEM;
+	}
+
+	for (i=0; i<OCT_NOBJS; i++) {
+		objs[i] = objcache_alloc(oc);
+		if (objs[i] == NULL) {
+			panic("objcachetest: out of memory\n");
+		}
+		KASSERT(objs[i]->o_magic == OCT_MAGIC);
+		objs[i]->o_value = i;
+	}
+	made = oct_ctors;
+	if (made != OCT_NOBJS) {
+		panic("objcachetest: %u constructors for %u objects\n",
+		      made, OCT_NOBJS);
+	}
+
+	for (i=0; i<OCT_NOBJS; i++) {
+		objcache_free(oc, objs[i]);
+	}
+	/* second round should reuse every one */
+	for (i=0; i<OCT_NOBJS; i++) {
+		objs[i] = objcache_alloc(oc);
+		if (objs[i] == NULL) {
+			panic("objcachetest: out of memory\n");
+		}
+		KASSERT(objs[i]->o_magic == OCT_MAGIC);
+	}
+	if (oct_ctors != made) {
+		panic("objcachetest: cached objects were constructed again\n");
+	}
+	for (i=0; i<OCT_NOBJS; i++) {
+		objcache_free(oc, objs[i]);
+	}
+	/* reclaiming gives them all back, as if memory had run out */
+	objcache_reclaim();
+	if (oct_dtors != oct_ctors) {
+		panic("objcachetest: %u objects cached after reclaim\n",
+		      oct_ctors - oct_dtors);
+	}
+
+	objcache_destroy(oc);
+	if (oct_dtors != oct_ctors) {
+		panic("objcachetest: %u objects made, %u destroyed\n",
+		      oct_ctors, oct_dtors);
+	}
+	kprintf("Object cache test done\n");
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <vm.h>
 
 /*
  * Time handling.
@@ -52,6 +53,7 @@
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define TLBSWEEP_HARDCLOCKS	8	/* Sweep the TLB every 8 hardclocks. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -97,6 +99,9 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if ((curcpu->c_hardclocks % TLBSWEEP_HARDCLOCKS) == 0) {
+		vm_tlbsweep();
+	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
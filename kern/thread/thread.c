@@ -53,6 +53,7 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <objcache.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +73,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Thread structures, kept with their stacks allocated. */
+static struct objcache *thread_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +115,32 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Object cache constructor and destructor for struct thread. A
+ * cached thread keeps its stack.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = kmalloc(STACK_SIZE);
+	if (thread->t_stack == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	kfree(thread->t_stack);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,14 +153,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -139,7 +169,7 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* t_stack comes from the cache */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -182,6 +212,11 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_tlbpid = 0;
+	c->c_tlbgen = 0;
+	c->c_tlbkept = 0;
+	c->c_tlbas = NULL;
+	c->c_tlbswept = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -205,18 +240,16 @@ cpu_create(unsigned hardware_number)
 
 	if (c->c_number == 0) {
 		/*
-		 * Leave c->c_curthread->t_stack NULL for the boot
+		 * Set c->c_curthread->t_stack NULL for the boot
 		 * cpu. This means we're using the boot stack, which
 		 * can't be freed. (Exercise: what would it take to
 		 * make it possible to free the boot stack?)
 		 */
-		/*c->c_curthread->t_stack = ... */
+		kfree(c->c_curthread->t_stack);
+		c->c_curthread->t_stack = NULL;
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
-		}
+		/* thread_create gave it a stack */
 		thread_checkstack_init(c->c_curthread);
 	}
 
@@ -255,6 +288,22 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus, and access to them by number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -277,9 +326,8 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	/* only the boot cpu's thread has none, and it never exits */
+	KASSERT(thread->t_stack != NULL);
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -287,7 +335,8 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	/* the stack goes back to the cache with it */
+	objcache_free(thread_cache, thread);
 }
 
 /*
@@ -376,6 +425,12 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = objcache_create("thread", sizeof(struct thread),
+				       thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -508,12 +563,7 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
+	/* The stack came with it; reset its guard */
 	thread_checkstack_init(newthread);
 
 	/*
@@ -639,6 +689,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, let the VM system wake any background work
+	 * waiting for this cpu to have nothing to do; if it did, look
+	 * at the run queue again instead.
 	 */
 
 	/* The current cpu is now idle. */
@@ -647,7 +701,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -816,6 +872,24 @@ thread_yield(void)
 	thread_switch(S_READY, NULL, NULL);
 }
 
+/*
+ * Check whether anything else is waiting to run on this cpu, for
+ * background work that should only use time nobody else wants. Only
+ * a hint: it may change as soon as the lock is dropped.
+ */
+bool
+thread_cpu_idle(void)
+{
+	struct cpu *c;
+	bool idle;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_runqueue_lock);
+	idle = threadlist_isempty(&c->c_runqueue);
+	spinlock_release(&c->c_runqueue_lock);
+	return idle;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1134,32 +1208,27 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Send a TLB shootdown IPI to the specified CPU. Any number of CPUs
+ * may be shooting down at once, so if the target's queue is full this
+ * waits for it to work through it. Call with no spinlocks held, so
+ * that shootdowns sent to this CPU meanwhile still get done.
  */
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	unsigned n;
 
-	spinlock_acquire(&target->c_ipi_lock);
-
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	KASSERT(curcpu->c_spinlocks == 0);
+	while (1) {
+		spinlock_acquire(&target->c_ipi_lock);
+		n = target->c_numshootdown;
+		if (n < TLBSHOOTDOWN_MAX) {
+			break;
+		}
+		spinlock_release(&target->c_ipi_lock);
 	}
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1204,9 +1273,9 @@ interprocessor_interrupt(void)
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * vm_tlbshootdown only takes the sender's wait
+		 * spinlock, so it is safe to call with the ipi lock
+		 * held.
 		 */
 		for (i=0; i<curcpu->c_numshootdown; i++) {
 			vm_tlbshootdown(&curcpu->c_shootdown[i]);
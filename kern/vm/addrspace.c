@@ -30,13 +30,17 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <objcache.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -48,6 +52,20 @@
  *
  */
 
+// Regions have nothing to construct; the cache hands the ones exit and
+// munmap free back to the next fork, exec or mmap on the same CPU
+static struct objcache *region_cache;
+
+void
+as_bootstrap(void)
+{
+    region_cache = objcache_create("region", sizeof(struct region),
+                                   NULL, NULL);
+    if(region_cache == NULL){
+        panic("as_bootstrap: Out of memory creating region cache\n");
+    }
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -57,23 +75,95 @@ as_create(void)
 	if (as == NULL) {
 		return NULL;
 	}
-    // set head as null and malloc the page table
-    as->region_head = NULL;
-    as->pagetable = kmalloc(sizeof(paddr_t *) * PT_FIRST_SIZE);
+    // no regions yet and malloc the page table
+    as->regions = NULL;
+    as->nregions = 0;
+    as->maxregions = 0;
+    as->last_region = NULL;
+    as->last_fault = 0;
+    as->heap = NULL;
+    as->heap_end = 0;
+    as->stack = NULL;
+    as->stack_limit = STACK_LIMIT;
+    // gets an address space ID when it first runs
+    as->asid = 0;
+    as->asid_gen = 0;
+    as->cpus = 0;
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        as->tlbswept[i] = 0;
+    }
+    as->transit = 0;
+    as->pt_lock = lock_create("pagetable");
+    if(as->pt_lock == NULL){
+        kfree(as);
+        return NULL;
+    }
+    as->pagetable = pt_create();
     // Did not set pagetable therefore no mem or error so free and return
     if(as->pagetable == NULL){
-        kfree(as->pagetable);
+        lock_destroy(as->pt_lock);
         kfree(as);
         return NULL;
     }
-    // Initialize first level
-    for(int i = 0; i < PT_FIRST_SIZE; i++){
-        as->pagetable[i] = NULL;
-    }
      
 	return as;
 }
 
+// pt_foreach callback for as_copy, shares one page of the old
+// address space with the new one
+static int
+as_copy_page(vaddr_t page, paddr_t pte, void *data)
+{
+    struct addrspace **pair = data;
+    struct addrspace *old = pair[0];
+    struct addrspace *newas = pair[1];
+
+    // mapped file pages stay shared and writable through the page cache
+    struct region *region = lookup_region(page, old);
+    if(REGION_CACHED(region)){
+        int result = insert_pt(page, pte, newas);
+        if(result){
+            return result;
+        }
+        pagecache_ref(region->vnode, REGION_FILEOFF(region, page));
+        return 0;
+    }
+    // paged out, bring it back in so both can share the frame
+    if(pte & PTE_SWAPPED){
+        int result = vm_pagein(page, old, &pte);
+        if(result){
+            return result;
+        }
+    }
+    pte &= ~(TLBLO_DIRTY | PTE_WRITE);
+    insert_pt(page, pte, old);
+    int result = insert_pt(page, pte, newas);
+    if(result){
+        return result;
+    }
+    vm_pte_share(pte);
+    return 0;
+}
+
+// pt_foreach callback for as_destroy
+static int
+as_destroy_page(vaddr_t page, paddr_t pte, void *data)
+{
+    struct addrspace *as = data;
+    struct region *region = lookup_region(page, as);
+    if(region != NULL && REGION_CACHED(region)){
+        pagecache_put(region->vnode, REGION_FILEOFF(region, page),
+                      pte & PTE_DIRTY);
+    }
+    else if(pte & PTE_SWAPPED){
+        swap_free(PTE_SWAPSLOT(pte));
+    }
+    else{
+        vm_pte_release(pte);
+    }
+    return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -84,82 +174,56 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	//create pagetable
-	newas->pagetable = kmalloc(PT_FIRST_SIZE*sizeof(paddr_t *));
-    if(newas->pagetable == NULL){
-        as_destroy(newas);
-        return ENOMEM;
-    }
-
-    for(int i = 0; i < PT_FIRST_SIZE; i++){
-        if(old->pagetable[i] == NULL){
-            newas->pagetable[i] = NULL;
-            continue;
-        }
-
-        //if there is a value in the old page table assign a new one
-        //for the new one to point to a new 2nd level page table
-        newas->pagetable[i] = kmalloc(sizeof(paddr_t *) * PT_SECOND_SIZE);
-        for(int j = 0;j < PT_SECOND_SIZE;j++){
-            if(old->pagetable[i][j] == 0){
-                newas->pagetable[i][j] = 0;
-            }
-            else{
-                // Allocate physical frame 
-                vaddr_t frame = alloc_kpages(1);
-                if(frame == 0){
-                    as_destroy(newas);
-                    return ENOMEM;
-                }
-                //set frame
-                paddr_t add_frame = KVADDR_TO_PADDR(frame);
-                newas->pagetable[i][j] = add_frame;
-                // copy mem
-                memcpy((void *) frame, (const void*)PADDR_TO_KVADDR(old->pagetable[i][j]), PAGE_SIZE);
-            }
-        }
-
-    }
-
-	if(old->region_head == NULL){
-		newas->region_head = NULL;
-	}else{
-		//copy region linked list
-		newas->region_head = kmalloc(sizeof(struct region));
-        if(newas->pagetable == NULL){
-            as_destroy(newas);
-            return ENOMEM;
-        }
-        //copy old region_head to new region_head
-		newas->region_head->base= old->region_head->base;
-		newas->region_head->permission = old->region_head->permission;
-		newas->region_head->size = old->region_head->size;
-
-		struct region *curOldNode = old->region_head->next;
-		struct region *curNode = newas->region_head;
-
-        //copy data from each old region node
-        //into a new region node, stop when old list ends
-		while(curOldNode!= NULL){
-			curNode->next = kmalloc(sizeof(struct region));
-            //return memory error if no page table
-            if(newas->pagetable == NULL){
-                as_destroy(newas);
-                return ENOMEM;
-            }
-            //copy data
-			curNode->next->base= curOldNode->base;
-			curNode->next->permission = curOldNode->permission;
-			curNode->next->size = curOldNode->size;
-
-            //incrament nodes to next node
-			curNode = curNode->next;
-			curOldNode = curOldNode->next;
-
+	//copy the region array, it is already sorted
+	if (old->nregions > 0) {
+		newas->regions = kmalloc(sizeof(struct region *) * old->nregions);
+		if (newas->regions == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
 		}
-
-		curNode->next = NULL;
+		newas->maxregions = old->nregions;
 	}
+	for (unsigned r = 0; r < old->nregions; r++) {
+		struct region *curNode = objcache_alloc(region_cache);
+		if (curNode == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		//copy data
+		*curNode = *old->regions[r];
+		curNode->prefilled = 0;
+		curNode->zeroahead = 0;
+		if (curNode->vnode != NULL) {
+			VOP_INCREF(curNode->vnode);
+		}
+		if (old->regions[r] == old->heap) {
+			newas->heap = curNode;
+		}
+		if (old->regions[r] == old->stack) {
+			newas->stack = curNode;
+		}
+		newas->regions[newas->nregions++] = curNode;
+	}
+	newas->heap_end = old->heap_end;
+	newas->stack_limit = old->stack_limit;
+
+    // Share every populated frame copy-on-write instead of copying it.
+    // Both page tables lose TLBLO_DIRTY and PTE_WRITE so the first write
+    // by either process faults with VM_FAULT_READONLY and gets its own
+    // copy. PTE_DIRTY stays, the copy still differs from any file.
+    struct addrspace *pair[2] = { old, newas };
+    vm_paging_lock(old);
+    int result = pt_foreach(old, as_copy_page, pair);
+
+    // the parent may still hold writable entries for the shared frames,
+    // on any CPU it ran on
+    vm_tlb_flush_as(old);
+    vm_paging_unlock(old);
+
+    if(result){
+        as_destroy(newas);
+        return result;
+    }
 
 	*ret = newas;
 	return 0;
@@ -168,32 +232,37 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-    //free all nodes in region linked list
-	struct region *curNode = as->region_head;
-	struct region *temp = NULL;
-
-
-	while(curNode != NULL){
-		temp = curNode->next ;
-		kfree(curNode);
-		curNode = temp;
-	}
-
     //free all pagetable entries and pagetable itself
+    //under the paging lock, so eviction can't pick one of our frames,
+    //once any pages it is writing out have landed in swap.
+    //This goes first, mapped file pages are found through their region
     if(as->pagetable != NULL){
-        for(int i = 0; i < PT_FIRST_SIZE; i++){
-            if (as->pagetable[i] != NULL){
-                for(int j = 0; j < PT_SECOND_SIZE; j++){
-                    if(as->pagetable[i][j] != 0){
-                        free_kpages(PADDR_TO_KVADDR(as->pagetable[i][j]));
-                    }
-                }
-                kfree(as->pagetable[i]);
-            }
-            
-        }
-        kfree(as->pagetable);
+        vm_paging_lock(as);
+        vm_wait_transit(as);
+        pt_foreach(as, as_destroy_page, as);
+        vm_paging_unlock(as);
+        pt_destroy(as->pagetable);
     }
+    lock_destroy(as->pt_lock);
+    // no CPU may go on thinking its TLB is for this one
+    vm_tlb_release(as);
+
+    //free all regions and the array
+	for (unsigned r = 0; r < as->nregions; r++) {
+		struct region *curNode = as->regions[r];
+		DEBUG(DB_VM, "region 0x%08x-0x%08x: %u pages prefilled, "
+		      "%u zeroed ahead\n", curNode->base,
+		      curNode->base + curNode->size, curNode->prefilled,
+		      curNode->zeroahead);
+		if (curNode->vnode != NULL) {
+			VOP_DECREF(curNode->vnode);
+		}
+		objcache_free(region_cache, curNode);
+	}
+	kfree(as->regions);
+	// write back and free file pages nothing maps any more
+	pagecache_reap();
+
     // free address space
 	kfree(as);
 }
@@ -201,8 +270,6 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
-    // FROM dumbvm
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -210,14 +277,9 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	// Load our address space ID, the TLB only gets flushed when
+	// the IDs run out
+	vm_tlb_activate(as);
 }
 
 void
@@ -228,14 +290,75 @@ as_deactivate(void)
 	 * anything. See proc.c for an explanation of why it (might)
 	 * be needed.
 	 */
-     // same as as_activate
-	int spl = splhigh();
+	// Nothing to do, entries of other address spaces don't match
+	// once as_activate has loaded a different address space ID
+}
 
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
+/*
+ * Add a region of MEMSIZE bytes at VADDR, both page aligned, keeping
+ * the array sorted. Fails with EINVAL if it would overlap another
+ * region. MEMSIZE may be 0 for a region that grows later, like the
+ * heap. Hands back the new region if RET isn't NULL.
+ */
+static int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+              int permission, struct region **ret)
+{
+    KASSERT((vaddr & PAGE_FRAME) == vaddr);
+    KASSERT(memsize % PAGE_SIZE == 0);
 
-	splx(spl);
+    // find where it goes in the sorted array, it may not overlap
+    unsigned pos = 0;
+    while(pos < as->nregions && as->regions[pos]->base < vaddr){
+        pos++;
+    }
+    if(pos > 0){
+        struct region *prev = as->regions[pos - 1];
+        if(prev->base + prev->size > vaddr){
+            return EINVAL;
+        }
+    }
+    if(pos < as->nregions && as->regions[pos]->base < vaddr + memsize){
+        return EINVAL;
+    }
+    // grow the array if it is full
+    if(as->nregions == as->maxregions){
+        unsigned newmax = as->maxregions ? as->maxregions * 2 : 4;
+        struct region **newregions = kmalloc(sizeof(struct region *) * newmax);
+        if(newregions == NULL){
+            return ENOMEM;
+        }
+        for(unsigned r = 0; r < as->nregions; r++){
+            newregions[r] = as->regions[r];
+        }
+        kfree(as->regions);
+        as->regions = newregions;
+        as->maxregions = newmax;
+    }
+    // make new region
+    struct region *new = objcache_alloc(region_cache);
+    if(new == NULL){
+        return ENOMEM;
+    }
+    new->base = vaddr;
+    new->size = memsize;
+    new->permission = permission;
+    new->prefilled = 0;
+    new->zeroahead = 0;
+    new->vnode = NULL;
+    new->offset = 0;
+    new->filestart = 0;
+    new->fileend = 0;
+    new->advice = MADV_NORMAL;
+    for(unsigned r = as->nregions; r > pos; r--){
+        as->regions[r] = as->regions[r - 1];
+    }
+    as->regions[pos] = new;
+    as->nregions++;
+    if(ret != NULL){
+        *ret = new;
+    }
+    return 0;
 }
 
 /*
@@ -256,30 +379,54 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
     if(as == NULL){
         return EFAULT;
     }
+    // Cover whole pages, the fault handler works a page at a time
+    memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+    vaddr &= PAGE_FRAME;
+    memsize = ROUNDUP(memsize, PAGE_SIZE);
     // Check it is valid region
-    if(vaddr + memsize > 0x80000000){
+    if(memsize == 0 || vaddr + memsize > USERSPACETOP || vaddr + memsize < vaddr){
         return EFAULT;
     }
-    // make new region
-    struct region *new = kmalloc(sizeof(struct region));
-    if(new == NULL){
-        return ENOMEM;
-    }
-    // Set base, size, the persmissions
-    new->permission = 0;
+    // Set the persmissions
+    int permission = 0;
     if(readable){
-        new->permission |= READ;
+        permission |= READ;
     }
     if(writeable){
-        new->permission |= WRITE;
+        permission |= WRITE;
     }
     if(executable){
-        new->permission |= EXECUTE;
+        permission |= EXECUTE;
+    }
+    return as_add_region(as, vaddr, memsize, permission, NULL);
+}
+
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+               size_t filesize, int readable, int writeable, int executable,
+               struct vnode *vn, off_t offset)
+{
+    if(filesize > memsize){
+        filesize = memsize;
+    }
+    int err = as_define_region(as, vaddr, memsize, readable, writeable,
+                               executable);
+    if(err){
+        return err;
+    }
+    // as_define_region started it on the page boundary below vaddr
+    struct region *region = lookup_region(vaddr, as);
+    VOP_INCREF(vn);
+    region->vnode = vn;
+    region->offset = offset - (off_t)(vaddr - region->base);
+    // Each page can be the file's page as it is, unless it gets written
+    // or part of it has to read as zeros
+    if(writeable || filesize != memsize ||
+       offset % PAGE_SIZE != (off_t)(vaddr % PAGE_SIZE)){
+        region->permission |= PRIVATE;
+        region->filestart = vaddr;
+        region->fileend = vaddr + filesize;
     }
-    new->base = vaddr;
-    new->size = memsize;
-    new->next = as->region_head;
-    as->region_head = new;
     return 0;
 }
 
@@ -290,18 +437,14 @@ as_prepare_load(struct addrspace *as)
     if(as == NULL){
         return EFAULT;
     }
-    struct region *curNode = as->region_head;
-
-    while(curNode != NULL){
-        // Check curNode is READ_ONLY or ReadExecute, not sure if we need to also
-        // include execute only
-        if(curNode->permission == READ || curNode->permission == (READ & EXECUTE)){
-            // set to writable
-            curNode->permission = curNode->permission | WRITE;
-            // set the 4th bith to 1 so that we know this a one that was changed 
-            curNode->permission = curNode->permission | 0x8;
+    for(unsigned r = 0; r < as->nregions; r++){
+        struct region *curNode = as->regions[r];
+        // Any region we can't write to yet has to be loaded, except
+        // the ones that come from the file through the page cache
+        if(!(curNode->permission & WRITE) && curNode->vnode == NULL){
+            // set to writable, and remember that it was changed
+            curNode->permission |= WRITE | LOADWRITE;
         }
-        curNode = curNode->next;
     }
     return 0;
 }
@@ -313,28 +456,37 @@ as_complete_load(struct addrspace *as)
 	if(as == NULL){
         return EFAULT;
     } 
-    struct region *curNode = as->region_head ;
-    while(curNode != NULL){
-        // check if the 4th bit is set
-        if(curNode->permission & 0x8){
-            // remove the write and 4th bit so its the old permission
-            // shift 1 to the second bit flip the bits and do an and function
-            curNode->permission &= ~(1 << 1);
-            // shift 1 to the fouth bit flip the bits and do an and function
-            curNode->permission &= ~(1 << 3);
-            // this should result into the origninal read or execute bits
-            // by setting write to 0 and 4th bit to 0
+    vm_paging_lock(as);
+    for(unsigned r = 0; r < as->nregions; r++){
+        struct region *curNode = as->regions[r];
+        if(!(curNode->permission & LOADWRITE)){
+            continue;
+        }
+        // remove the write and load bits so its the old permission
+        curNode->permission &= ~(WRITE | LOADWRITE);
+        // and take write access away from the pages loaded into it
+        for(vaddr_t page = curNode->base; page < curNode->base + curNode->size;
+            page += PAGE_SIZE){
+            paddr_t pte = lookup_pt(page, as);
+            if(pte & TLBLO_VALID){
+                insert_pt(page, pte & ~(TLBLO_DIRTY | PTE_WRITE), as);
+            }
         }
-        curNode = curNode->next;
     }
-    // flush tlb
-	int spl = splhigh();
-
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+    // flush our tlb entries, the loaded pages may be writable there
+    vm_tlb_flush_as(as);
+    vm_paging_unlock(as);
+
+    // the heap starts out empty just past the program
+    if(as->nregions > 0 && as->heap == NULL){
+        struct region *last = as->regions[as->nregions - 1];
+        int err = as_add_region(as, last->base + last->size, 0,
+                                READ | WRITE, &as->heap);
+        if(err){
+            return err;
+        }
+        as->heap_end = as->heap->base;
+    }
     return 0;
 }
 
@@ -345,8 +497,9 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
     size_t size = NUM_STACK * PAGE_SIZE;
     // adress of the stack base
     vaddr_t stack = USERSTACK - size;
-    // define the stack and make it so it is read and write
-    int ret = as_define_region(as, stack, size, 1, 1, 0);
+    // define the stack and make it so it is read and write, vm_fault
+    // grows it from there
+    int ret = as_add_region(as, stack, size, READ | WRITE, &as->stack);
     if(ret){
         return ret;
     }
@@ -355,3 +508,117 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+    struct region *heap = as->heap;
+    if(heap == NULL){
+        return ENOMEM;
+    }
+    vaddr_t oldend = as->heap_end;
+    vaddr_t newend = oldend + amount;
+    // can't give back more than there is
+    if(amount < 0 && (newend > oldend || newend < heap->base)){
+        return EINVAL;
+    }
+    if(amount > 0 && (newend < oldend || newend > USERSPACETOP - PAGE_SIZE)){
+        return ENOMEM;
+    }
+    vaddr_t oldtop = heap->base + heap->size;
+    vaddr_t newtop = ROUNDUP(newend, PAGE_SIZE);
+    // growing, don't run into the next region up, or the stack's guard
+    if(newtop > oldtop){
+        for(unsigned r = 0; r < as->nregions; r++){
+            struct region *curNode = as->regions[r];
+            vaddr_t guard = curNode == as->stack ? PAGE_SIZE : 0;
+            if(curNode != heap && curNode->base >= oldtop &&
+               curNode->base < newtop + guard){
+                return ENOMEM;
+            }
+        }
+    }
+
+    vm_paging_lock(as);
+    heap->size = newtop - heap->base;
+    // shrinking, the pages past the new top go now
+    if(newtop < oldtop){
+        vm_unmap(as, heap, newtop, oldtop);
+    }
+    as->heap_end = newend;
+    vm_paging_unlock(as);
+
+    *oldbreak = oldend;
+    return 0;
+}
+
+// Mappings go top down from here, below the most the stack grows to
+// and its guard page
+#define MMAP_TOP (USERSTACK - STACK_LIMIT - PAGE_SIZE)
+
+int
+as_mmap(struct addrspace *as, size_t length, int permission,
+        struct vnode *vn, off_t offset, vaddr_t *addr)
+{
+    KASSERT(offset % PAGE_SIZE == 0);
+    length = ROUNDUP(length, PAGE_SIZE);
+    if(length == 0 || length > MMAP_TOP){
+        return ENOMEM;
+    }
+    // highest gap below MMAP_TOP it fits in
+    vaddr_t top = MMAP_TOP;
+    for(unsigned r = as->nregions; r-- > 0;){
+        struct region *curNode = as->regions[r];
+        if(curNode->base >= top){
+            continue;
+        }
+        vaddr_t end = curNode->base + curNode->size;
+        if(end <= top && top - end >= length){
+            break;
+        }
+        top = curNode->base;
+    }
+    // never map the first page, so NULL stays invalid
+    if(top < length + PAGE_SIZE){
+        return ENOMEM;
+    }
+
+    struct region *region;
+    int err = as_add_region(as, top - length, length, permission | MAPPED,
+                            &region);
+    if(err){
+        return err;
+    }
+    VOP_INCREF(vn);
+    region->vnode = vn;
+    region->offset = offset;
+    *addr = region->base;
+    return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+    unsigned r = 0;
+    while(r < as->nregions && as->regions[r]->base != addr){
+        r++;
+    }
+    // only mappings made by as_mmap can go
+    if(r == as->nregions || !(as->regions[r]->permission & MAPPED)){
+        return EINVAL;
+    }
+    struct region *region = as->regions[r];
+
+    vm_paging_lock(as);
+    vm_unmap(as, region, region->base, region->base + region->size);
+    for(; r + 1 < as->nregions; r++){
+        as->regions[r] = as->regions[r + 1];
+    }
+    as->nregions--;
+    as->last_region = NULL;
+    vm_paging_unlock(as);
+
+    VOP_DECREF(region->vnode);
+    objcache_free(region_cache, region);
+    pagecache_reap();
+    return 0;
+}
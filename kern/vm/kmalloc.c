@@ -31,6 +31,10 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include <current.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <clock.h>
 
 /*
  * Kernel malloc.
@@ -160,14 +164,28 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the heap pages. Each CPU also caches free
+ * blocks of each size (see below), so the lock is only taken when a
+ * cache runs empty or full.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+#define KMALLOC_CACHE_SIZE 16	/* blocks of each size a CPU may hold */
+#define KMALLOC_CACHE_BATCH 8	/* blocks moved to or from the pages */
+
+struct kmalloc_cache {
+	struct spinlock kc_lock;
+	unsigned kc_count;		/* blocks in kc_blocks */
+	vaddr_t kc_blocks[KMALLOC_CACHE_SIZE];
+	unsigned kc_hits;		/* allocations served from the cache */
+	unsigned kc_refills;		/* batches taken from the pages */
+	unsigned kc_drains;		/* batches given back */
+};
+
+static struct kmalloc_cache kmalloc_caches[MAXCPUS][NSIZES];
+static bool kmalloc_caches_ready;	/* set once by kheap_bootstrap */
+
 ////////////////////////////////////////
 
 /*
@@ -697,6 +715,25 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+static void kmalloc_cache_drain_all(void);
+
+/*
+ * Set up the per-CPU caches. Until this runs every allocation goes
+ * to the heap pages under kmalloc_spinlock.
+ */
+void
+kheap_bootstrap(void)
+{
+	unsigned i, j;
+
+	for (i=0; i<MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			spinlock_init(&kmalloc_caches[i][j].kc_lock);
+		}
+	}
+	kmalloc_caches_ready = true;
+}
+
 void
 kheap_nextgeneration(void)
 {
@@ -711,6 +748,9 @@ void
 kheap_dump(void)
 {
 #ifdef LABELS
+	/* cached blocks would show up as leaks */
+	kmalloc_cache_drain_all();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 	dump_subpages(mallocgeneration);
@@ -726,6 +766,8 @@ kheap_dumpall(void)
 #ifdef LABELS
 	unsigned i;
 
+	kmalloc_cache_drain_all();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 	for (i=0; i<=mallocgeneration; i++) {
@@ -801,6 +843,23 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i, j, hits, refills, drains;
+
+	for (j=0; j<NSIZES && kmalloc_caches_ready; j++) {
+		hits = refills = drains = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			spinlock_acquire(&kmalloc_caches[i][j].kc_lock);
+			hits += kmalloc_caches[i][j].kc_hits;
+			refills += kmalloc_caches[i][j].kc_refills;
+			drains += kmalloc_caches[i][j].kc_drains;
+			spinlock_release(&kmalloc_caches[i][j].kc_lock);
+		}
+		kprintf("Size %-4lu cache: %u hits, %u refills, %u drains\n",
+			(unsigned long) sizes[j], hits, refills, drains);
+	}
+
+	/* cached blocks would show up as allocated */
+	kmalloc_cache_drain_all();
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -867,92 +926,81 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take the first free block off the free list of the heap page PR.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+vaddr_t
+subpage_pop(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t block;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	block = fla;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return block;
+}
+
+/*
+ * Take up to N free blocks of type BLKTYPE off the heap pages into
+ * BLOCKS, making a new page if none has any. Returns how many it got,
+ * which is 0 only if out of memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, vaddr_t *blocks, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	unsigned got;		// blocks taken so far
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
+	KASSERT(n > 0);
+	got = 0;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = subpage_pop(pr);
 		}
 	}
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
 
 	/*
 	 * No page of the right size available.
@@ -968,22 +1016,25 @@ subpage_kmalloc(size_t sz
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		return 0;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
 #endif
+	/* let kfree find the block size without the lock */
+	frame_set_subpage(prpage, blktype);
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
+		frame_set_subpage(prpage, -1);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -1013,20 +1064,28 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	while (pr->nfree > 0 && got < n) {
+		blocks[got++] = subpage_pop(pr);
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return got;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Put the block at BLOCKADDR back on the free list of its heap page.
+ * If that leaves the page wholly free, the page is taken out of the
+ * heap and handed back in *FREEPAGE for the caller to free once it
+ * has released the lock; otherwise *FREEPAGE is 0. If the block is
+ * not on any heap page we recognize, return -1.
  */
 static
 int
-subpage_kfree(void *ptr)
+subpage_putblock(vaddr_t blockaddr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -1036,34 +1095,8 @@ subpage_kfree(void *ptr)
 	size_t blocksize, smallerblocksize;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	*freepage = 0;
 
 	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
 	prpage = 0;
@@ -1078,35 +1111,35 @@ subpage_kfree(void *ptr)
 		KASSERT(blktype>=0 && blktype<NSIZES);
 		checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+		if (blockaddr >= prpage && blockaddr < prpage + PAGE_SIZE) {
 			break;
 		}
 	}
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	offset = blockaddr - prpage;
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)blockaddr);
 	}
 
 #ifdef GUARDS
 	blocksize = sizes[blktype];
 	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
+	checkguardband(blockaddr, smallerblocksize, blocksize);
 #endif
 
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+	fill_deadbeef((void *)blockaddr, sizes[blktype]);
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -1142,12 +1175,315 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Give N blocks back to their heap pages under one acquisition of the
+ * lock, then free the pages that became empty.
+ */
+static
+void
+subpage_putblocks(const vaddr_t *blocks, unsigned n)
+{
+	vaddr_t freepages[KMALLOC_CACHE_BATCH];
+	unsigned i, nfreepages;
+	int result;
+
+	KASSERT(n <= KMALLOC_CACHE_BATCH);
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<n; i++) {
+		result = subpage_putblock(blocks[i], &freepages[nfreepages]);
+		KASSERT(result == 0);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		frame_set_subpage(freepages[i], -1);
+		free_kpages(freepages[i]);
+	}
+}
+
+////////////////////////////////////////
+
+/*
+ * Per-CPU caches. Each CPU keeps a small stack of free blocks of each
+ * size, so that most kmalloc/kfree calls only take the CPU's own
+ * cache lock and never touch kmalloc_spinlock. Blocks move between a
+ * cache and the heap pages KMALLOC_CACHE_BATCH at a time. A cached
+ * block is still allocated as far as its page is concerned, so the
+ * page can't be freed while it sits there.
+ *
+ * kfree can only use a cache if it can tell the block's size without
+ * the lock, from the frame table (frame_subpage); otherwise it takes
+ * the block straight back to its page as before.
+ */
+static
+struct kmalloc_cache *
+kmalloc_cache_get(unsigned blktype)
+{
+#ifdef CHECKGUARDS
+	/* checksubpage would take cached blocks for damaged ones */
+	(void)blktype;
+	return NULL;
+#else
+	/* early in boot, before kheap_bootstrap or curcpu */
+	if (!kmalloc_caches_ready || curthread == NULL) {
+		return NULL;
+	}
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &kmalloc_caches[curcpu->c_number][blktype];
+#endif
+}
+
+/*
+ * Get a block of type BLKTYPE from cache KC, refilling the cache from
+ * the heap pages if it's empty. Returns 0 if out of memory.
+ */
+static
+vaddr_t
+kmalloc_cache_alloc(struct kmalloc_cache *kc, unsigned blktype)
+{
+	vaddr_t blocks[KMALLOC_CACHE_BATCH];
+	vaddr_t block;
+	unsigned i, n;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_count > 0) {
+		block = kc->kc_blocks[--kc->kc_count];
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return block;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Refill without the cache lock; alloc_kpages may come back here */
+	n = subpage_getblocks(blktype, blocks, KMALLOC_CACHE_BATCH);
+	if (n == 0) {
+		return 0;
+	}
+
+	/* we may be on another CPU by now, any cache will do */
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_refills++;
+	for (i=1; i<n && kc->kc_count < KMALLOC_CACHE_SIZE; i++) {
+		kc->kc_blocks[kc->kc_count++] = blocks[i];
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (i < n) {
+		/* the cache filled up meanwhile */
+		subpage_putblocks(&blocks[i], n - i);
+	}
+	return blocks[0];
+}
+
+/*
+ * Put the block at BLOCKADDR in cache KC, draining a batch back to the
+ * heap pages first if the cache is full.
+ */
+static
+void
+kmalloc_cache_free(struct kmalloc_cache *kc, vaddr_t blockaddr)
+{
+	vaddr_t blocks[KMALLOC_CACHE_BATCH];
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_count == KMALLOC_CACHE_SIZE) {
+		while (n < KMALLOC_CACHE_BATCH) {
+			blocks[n++] = kc->kc_blocks[--kc->kc_count];
+		}
+		kc->kc_drains++;
+	}
+	kc->kc_blocks[kc->kc_count++] = blockaddr;
+	spinlock_release(&kc->kc_lock);
+
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+}
+
+/*
+ * Empty every CPU's caches, so the heap pages show what is really in
+ * use.
+ */
+static
+void
+kmalloc_cache_drain_all(void)
+{
+	vaddr_t blocks[KMALLOC_CACHE_BATCH];
+	struct kmalloc_cache *kc;
+	unsigned i, j, n;
+
+	if (!kmalloc_caches_ready) {
+		return;
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			kc = &kmalloc_caches[i][j];
+			do {
+				n = 0;
+				spinlock_acquire(&kc->kc_lock);
+				while (n < KMALLOC_CACHE_BATCH &&
+				       kc->kc_count > 0) {
+					blocks[n++] =
+					    kc->kc_blocks[--kc->kc_count];
+				}
+				spinlock_release(&kc->kc_lock);
+				if (n > 0) {
+					subpage_putblocks(blocks, n);
+				}
+			} while (n > 0);
+		}
+	}
+}
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct kmalloc_cache *kc;	// this CPU's cache for blktype
+	vaddr_t block;		// block we're allocating
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	kc = kmalloc_cache_get(blktype);
+	if (kc != NULL) {
+		block = kmalloc_cache_alloc(kc, blktype);
+	}
+	else if (subpage_getblocks(blktype, &block, 1) == 0) {
+		block = 0;
+	}
+	if (block == 0) {
+		return NULL;
+	}
+
+	retptr = (void *)block;
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+	return retptr;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] of the block, or -1
+	struct kmalloc_cache *kc;	// this CPU's cache for blktype
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t freepage;	// heap page left empty by the free
+	int result;
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	blktype = frame_subpage(ptraddr);
+	kc = blktype >= 0 ? kmalloc_cache_get(blktype) : NULL;
+	if (kc != NULL) {
+		KASSERT(blktype < NSIZES);
+		/* Check for proper positioning and alignment */
+		if ((ptraddr % PAGE_SIZE) % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+#ifdef GUARDS
+		blocksize = sizes[blktype];
+		smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+		checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+		/* deadbeef it as the free list would */
+		fill_deadbeef((void *)ptraddr, sizes[blktype]);
+		kmalloc_cache_free(kc, ptraddr);
+		return 0;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	result = subpage_putblock(ptraddr, &freepage);
+
+	spinlock_release(&kmalloc_spinlock);
+
+	if (freepage != 0) {
+		/* Call free_kpages without kmalloc_spinlock. */
+		frame_set_subpage(freepage, -1);
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1156,31 +1492,306 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
-	return 0;
+	return result;
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////
+
+/*
+ * Allocation-site profiler.
+ *
+ * Unlike LABELS this is always built in. Every kprof_rate'th kmalloc
+ * on each CPU is sampled: its caller's PC is counted in a fixed
+ * table of sites, and the block goes in a small hash of live samples
+ * so that kfree can take it off its site again. Counts are of
+ * samples; kprof_printstats scales them up by the rate. A rate of 0
+ * turns sampling off.
+ *
+ * Unsampled kmallocs only count down a per-CPU counter, and kfree
+ * only takes kprof_lock if the block's hash chain has something on
+ * it.
+ */
+
+#define KPROF_RATE	64	/* default: sample 1 in 64 */
+#define KPROF_SITES	64	/* distinct callers */
+#define KPROF_SAMPLES	256	/* sampled blocks tracked until freed */
+#define KPROF_BUCKETS	64	/* hash chains for them */
+
+#define KPROF_HASH(va)	((((va) >> 4) ^ ((va) >> 12)) % KPROF_BUCKETS)
+
+struct kprof_site {
+	vaddr_t ks_pc;			/* caller; 0 if the slot is unused */
+	unsigned ks_allocs;		/* samples */
+	unsigned ks_interval;		/* samples since the last dump */
+	unsigned ks_live;		/* samples not freed yet */
+	size_t ks_livebytes;		/* their total size */
+	size_t ks_bytes;		/* total size of all samples */
+};
+
+struct kprof_sample {
+	vaddr_t kp_block;
+	size_t kp_size;
+	struct kprof_site *kp_site;
+	struct kprof_sample *kp_next;	/* hash chain or free list */
+};
+
+/* protects everything below but the countdowns */
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static unsigned kprof_rate = KPROF_RATE;
+static struct kprof_site kprof_sites[KPROF_SITES];
+static struct kprof_sample kprof_samples[KPROF_SAMPLES];
+static unsigned kprof_used;		/* kprof_samples handed out so far */
+static struct kprof_sample *kprof_freesamples;
+static struct kprof_sample *kprof_live[KPROF_BUCKETS];
+static unsigned kprof_lost;		/* samples with no site slot */
+static unsigned kprof_untracked;	/* samples with no live slot */
+static struct timespec kprof_since;	/* last dump; 0 if none yet */
+
+/* kmallocs to go until the next sample; unlocked, so only roughly */
+static unsigned kprof_countdown[MAXCPUS];
+
+/*
+ * Find (or add) the site for caller PC. Returns NULL if the table is
+ * full.
+ */
+static
+struct kprof_site *
+kprof_findsite(vaddr_t pc)
+{
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+
+	i = (pc >> 2) % KPROF_SITES;
+	for (n = 0; n < KPROF_SITES; n++, i = (i + 1) % KPROF_SITES) {
+		if (kprof_sites[i].ks_pc == pc) {
+			return &kprof_sites[i];
+		}
+		if (kprof_sites[i].ks_pc == 0) {
+			kprof_sites[i].ks_pc = pc;
+			return &kprof_sites[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Called by kmalloc with each block it hands out to CALLER.
+ */
+static
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	unsigned *countdown;
+	struct kprof_site *site;
+	struct kprof_sample *sample;
+	vaddr_t block = (vaddr_t)ptr;
+
+	/* early in boot, before curcpu */
+	if (ptr == NULL || kprof_rate == 0 || curthread == NULL) {
+		return;
+	}
+	KASSERT(curcpu->c_number < MAXCPUS);
+	countdown = &kprof_countdown[curcpu->c_number];
+	if (*countdown > 1) {
+		(*countdown)--;
+		return;
+	}
+	*countdown = kprof_rate;
+
+	spinlock_acquire(&kprof_lock);
+	site = kprof_findsite(caller);
+	if (site == NULL) {
+		kprof_lost++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	site->ks_allocs++;
+	site->ks_interval++;
+	site->ks_bytes += sz;
+
+	if (kprof_freesamples != NULL) {
+		sample = kprof_freesamples;
+		kprof_freesamples = sample->kp_next;
+	}
+	else if (kprof_used < KPROF_SAMPLES) {
+		sample = &kprof_samples[kprof_used++];
+	}
+	else {
+		kprof_untracked++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	sample->kp_block = block;
+	sample->kp_size = sz;
+	sample->kp_site = site;
+	sample->kp_next = kprof_live[KPROF_HASH(block)];
+	kprof_live[KPROF_HASH(block)] = sample;
+	site->ks_live++;
+	site->ks_livebytes += sz;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Called by kfree with each block it gets back.
+ */
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_sample **pp, *sample;
+	vaddr_t block = (vaddr_t)ptr;
+	unsigned bucket = KPROF_HASH(block);
+
+	/*
+	 * If this block was sampled, its entry was on the chain before
+	 * kmalloc returned it and only we can take it off, so an empty
+	 * chain means it wasn't.
+	 */
+	if (kprof_live[bucket] == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kprof_lock);
+	for (pp = &kprof_live[bucket]; *pp != NULL; pp = &(*pp)->kp_next) {
+		sample = *pp;
+		if (sample->kp_block == block) {
+			*pp = sample->kp_next;
+			sample->kp_site->ks_live--;
+			sample->kp_site->ks_livebytes -= sample->kp_size;
+			sample->kp_next = kprof_freesamples;
+			kprof_freesamples = sample;
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Forget everything and sample 1 in RATE kmallocs from now on (none
+ * if RATE is 0).
+ */
+void
+kprof_setrate(unsigned rate)
+{
+	struct timespec now;
+	unsigned i;
+
+	gettime(&now);
+
+	spinlock_acquire(&kprof_lock);
+	bzero(kprof_sites, sizeof(kprof_sites));
+	bzero(kprof_live, sizeof(kprof_live));
+	kprof_freesamples = NULL;
+	kprof_used = 0;
+	kprof_lost = 0;
+	kprof_untracked = 0;
+	for (i = 0; i < MAXCPUS; i++) {
+		kprof_countdown[i] = 0;
+	}
+	kprof_rate = rate;
+	kprof_since = now;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the sites, biggest estimated live bytes first. Allocation
+ * rates are since the last dump or kprof_setrate.
+ */
+void
+kprof_printstats(void)
+{
+	struct timespec now, elapsed;
+	struct kprof_site *ks;
+	bool printed[KPROF_SITES];
+	unsigned i, best, n, ms, rate;
+
+	gettime(&now);
+
+	spinlock_acquire(&kprof_lock);
+	if (kprof_rate == 0) {
+		kprintf("Allocation-site profiling is off\n");
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	ms = 0;
+	if (kprof_since.tv_sec != 0) {
+		timespec_sub(&now, &kprof_since, &elapsed);
+		ms = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+	}
+
+	kprintf("kmalloc sites, 1 in %u sampled (estimates):\n", kprof_rate);
+	kprintf("  caller        allocs  allocs/s      live  live bytes"
+		"  avg size\n");
+	for (i = 0; i < KPROF_SITES; i++) {
+		printed[i] = false;
+	}
+	for (n = 0; n < KPROF_SITES; n++) {
+		best = KPROF_SITES;
+		for (i = 0; i < KPROF_SITES; i++) {
+			if (printed[i] || kprof_sites[i].ks_pc == 0) {
+				continue;
+			}
+			if (best == KPROF_SITES ||
+			    kprof_sites[i].ks_livebytes >
+			    kprof_sites[best].ks_livebytes) {
+				best = i;
+			}
+		}
+		if (best == KPROF_SITES) {
+			break;
+		}
+		printed[best] = true;
+		ks = &kprof_sites[best];
+
+		rate = 0;
+		if (ms > 0) {
+			rate = (uint64_t)ks->ks_interval * kprof_rate * 1000
+				/ ms;
+		}
+		kprintf("  0x%08lx %9lu %9u %9lu %11lu %9lu\n",
+			(unsigned long) ks->ks_pc,
+			(unsigned long) ks->ks_allocs * kprof_rate,
+			rate,
+			(unsigned long) ks->ks_live * kprof_rate,
+			(unsigned long) ks->ks_livebytes * kprof_rate,
+			(unsigned long) (ks->ks_bytes / ks->ks_allocs));
+		ks->ks_interval = 0;
+	}
+	if (ms == 0) {
+		kprintf("(no allocs/s until the next dump)\n");
+	}
+	if (kprof_lost > 0 || kprof_untracked > 0) {
+		kprintf("%u samples from sites past the first %u, "
+			"%u not tracked until freed\n",
+			kprof_lost, KPROF_SITES, kprof_untracked);
+	}
+	kprof_since = now;
+	spinlock_release(&kprof_lock);
+}
+
+////////////////////////////////////////
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * alloc_kpages depending on how big SZ is, falling back on vmalloc
+ * for big ones when memory is too fragmented.
  */
 void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
-#ifdef LABELS
-	vaddr_t label;
-#endif
+	vaddr_t caller;
+	void *ptr;
 
-#ifdef LABELS
 #ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
+	caller = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
-#endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
@@ -1190,19 +1801,25 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+		if (address==0 && npages > 1) {
+			/* No contiguous run; stitch single frames together. */
+			ptr = vmalloc(npages * PAGE_SIZE);
+		}
+		else {
+			KASSERT(address % PAGE_SIZE == 0);
+			ptr = (void *)address;
 		}
-		KASSERT(address % PAGE_SIZE == 0);
-
-		return (void *)address;
 	}
-
+	else {
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+		ptr = subpage_kmalloc(sz, caller);
 #else
-	return subpage_kmalloc(sz);
+		ptr = subpage_kmalloc(sz);
 #endif
+	}
+
+	kprof_alloc(ptr, sz, caller);
+	return ptr;
 }
 
 /*
@@ -1216,6 +1833,10 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
+	}
+	kprof_free(ptr);
+	if (vmalloc_contains(ptr)) {
+		vfree(ptr);
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <objcache.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Object caches. See objcache.h.
+ *
+ * Objects are kmalloc blocks, so they come out of the subpage
+ * allocator's pages of the matching size (or whole pages for big
+ * ones), which already carves pages up by size and keeps per-CPU
+ * caches of its own. What an object cache adds on top is keeping
+ * freed objects constructed.
+ *
+ * Like kmalloc's, the caches are per CPU: each CPU keeps up to
+ * OBJCACHE_CPU_SIZE freed objects of a cache under a lock only it
+ * normally takes, and moves them OBJCACHE_BATCH at a time to or from
+ * a depot of up to OBJCACHE_MAX shared by all CPUs. Objects freed
+ * past that are destructed and go back to kmalloc. A CPU that finds
+ * both its own cache and the depot empty takes an object another CPU
+ * has cached before constructing a new one, as constructing may cost
+ * a stack.
+ *
+ * Lock order: objcache_listlock, then a CPU's occ_lock, then the
+ * depot's oc_lock.
+ */
+
+#define OBJCACHE_MAX 16		/* objects in the depot */
+#define OBJCACHE_CPU_SIZE 8	/* objects a CPU may hold */
+#define OBJCACHE_BATCH 4	/* objects moved to or from the depot */
+
+struct objcache_cpu {
+	struct spinlock occ_lock;	/* protects the rest */
+	unsigned occ_count;		/* objects in occ_objs */
+	void *occ_objs[OBJCACHE_CPU_SIZE];
+	int occ_inuse;			/* handed out less freed, here */
+	unsigned occ_hits;		/* allocations of cached objects */
+};
+
+struct objcache {
+	char *oc_name;
+	size_t oc_size;
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+	struct spinlock oc_lock;	/* protects the depot and counts */
+	unsigned oc_count;		/* objects in oc_free */
+	void *oc_free[OBJCACHE_MAX];
+	unsigned oc_constructs;		/* objects made */
+	unsigned oc_destructs;		/* objects given back to kmalloc */
+	struct objcache *oc_next;	/* objcache_list */
+	struct objcache_cpu oc_cpus[MAXCPUS];
+};
+
+/* every cache, for objcache_printstats and objcache_reclaim */
+static struct spinlock objcache_listlock = SPINLOCK_INITIALIZER;
+static struct objcache *objcache_list;
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+	unsigned i;
+
+	KASSERT(size > 0);
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = kstrdup(name);
+	if (oc->oc_name == NULL) {
+		kfree(oc);
+		return NULL;
+	}
+	oc->oc_size = size;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_count = 0;
+	oc->oc_constructs = 0;
+	oc->oc_destructs = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&oc->oc_cpus[i].occ_lock);
+		oc->oc_cpus[i].occ_count = 0;
+		oc->oc_cpus[i].occ_inuse = 0;
+		oc->oc_cpus[i].occ_hits = 0;
+	}
+
+	spinlock_acquire(&objcache_listlock);
+	oc->oc_next = objcache_list;
+	objcache_list = oc;
+	spinlock_release(&objcache_listlock);
+
+	return oc;
+}
+
+/*
+ * The calling CPU's part of cache OC. Early in boot, before there is
+ * a curthread, only the boot CPU (cpu 0) is running.
+ */
+static
+struct objcache_cpu *
+objcache_cpu(struct objcache *oc)
+{
+	if (curthread == NULL) {
+		return &oc->oc_cpus[0];
+	}
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &oc->oc_cpus[curcpu->c_number];
+}
+
+/*
+ * Destruct an object and give its memory back.
+ */
+static
+void
+objcache_release(struct objcache *oc, void *obj)
+{
+	if (oc->oc_dtor != NULL) {
+		oc->oc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **p;
+	struct objcache_cpu *occ;
+	unsigned i, j;
+	int inuse;
+
+	inuse = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		inuse += oc->oc_cpus[i].occ_inuse;
+	}
+	KASSERT(inuse == 0);
+
+	spinlock_acquire(&objcache_listlock);
+	for (p = &objcache_list; *p != oc; p = &(*p)->oc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = oc->oc_next;
+	spinlock_release(&objcache_listlock);
+
+	for (i=0; i<MAXCPUS; i++) {
+		occ = &oc->oc_cpus[i];
+		for (j=0; j<occ->occ_count; j++) {
+			objcache_release(oc, occ->occ_objs[j]);
+		}
+		spinlock_cleanup(&occ->occ_lock);
+	}
+	for (i=0; i<oc->oc_count; i++) {
+		objcache_release(oc, oc->oc_free[i]);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc->oc_name);
+	kfree(oc);
+}
+
+/*
+ * Take an object some CPU has cached, or NULL if none has one. Only
+ * used when constructing a new object is the alternative.
+ */
+static
+void *
+objcache_steal(struct objcache *oc)
+{
+	struct objcache_cpu *occ;
+	void *obj;
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		occ = &oc->oc_cpus[i];
+		/* an unlocked look first, most are empty */
+		if (occ->occ_count == 0) {
+			continue;
+		}
+		spinlock_acquire(&occ->occ_lock);
+		if (occ->occ_count > 0) {
+			obj = occ->occ_objs[--occ->occ_count];
+			spinlock_release(&occ->occ_lock);
+			return obj;
+		}
+		spinlock_release(&occ->occ_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Make a new object. Called with no spinlocks held; the constructor
+ * may kmalloc.
+ */
+static
+void *
+objcache_make(struct objcache *oc)
+{
+	void *obj;
+	int result;
+
+	obj = kmalloc(oc->oc_size);
+	if (obj != NULL && oc->oc_ctor != NULL) {
+		result = oc->oc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			obj = NULL;
+		}
+	}
+	if (obj != NULL) {
+		spinlock_acquire(&oc->oc_lock);
+		oc->oc_constructs++;
+		spinlock_release(&oc->oc_lock);
+	}
+	return obj;
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objcache_cpu *occ;
+	void *obj;
+	bool reused;
+
+	occ = objcache_cpu(oc);
+	spinlock_acquire(&occ->occ_lock);
+	if (occ->occ_count == 0) {
+		/* refill a batch from the depot */
+		spinlock_acquire(&oc->oc_lock);
+		while (occ->occ_count < OBJCACHE_BATCH && oc->oc_count > 0) {
+			occ->occ_objs[occ->occ_count++] =
+				oc->oc_free[--oc->oc_count];
+		}
+		spinlock_release(&oc->oc_lock);
+	}
+	if (occ->occ_count > 0) {
+		obj = occ->occ_objs[--occ->occ_count];
+		occ->occ_inuse++;
+		occ->occ_hits++;
+		spinlock_release(&occ->occ_lock);
+		return obj;
+	}
+	spinlock_release(&occ->occ_lock);
+
+	obj = objcache_steal(oc);
+	reused = obj != NULL;
+	if (obj == NULL) {
+		obj = objcache_make(oc);
+		if (obj == NULL) {
+			return NULL;
+		}
+	}
+
+	/* we may be on another CPU by now, any will do for counting */
+	occ = objcache_cpu(oc);
+	spinlock_acquire(&occ->occ_lock);
+	occ->occ_inuse++;
+	if (reused) {
+		occ->occ_hits++;
+	}
+	spinlock_release(&occ->occ_lock);
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objcache_cpu *occ;
+	void *extra[OBJCACHE_BATCH];
+	void *moving;
+	unsigned i, n;
+
+	KASSERT(obj != NULL);
+
+	n = 0;
+	occ = objcache_cpu(oc);
+	spinlock_acquire(&occ->occ_lock);
+	occ->occ_inuse--;
+	if (occ->occ_count == OBJCACHE_CPU_SIZE) {
+		/* move a batch to the depot, destroying what won't fit */
+		spinlock_acquire(&oc->oc_lock);
+		for (i=0; i<OBJCACHE_BATCH; i++) {
+			moving = occ->occ_objs[--occ->occ_count];
+			if (oc->oc_count < OBJCACHE_MAX) {
+				oc->oc_free[oc->oc_count++] = moving;
+			}
+			else {
+				extra[n++] = moving;
+			}
+		}
+		oc->oc_destructs += n;
+		spinlock_release(&oc->oc_lock);
+	}
+	occ->occ_objs[occ->occ_count++] = obj;
+	spinlock_release(&occ->occ_lock);
+
+	for (i=0; i<n; i++) {
+		objcache_release(oc, extra[i]);
+	}
+}
+
+unsigned
+objcache_reclaim(void)
+{
+	struct objcache *oc;
+	struct objcache_cpu *occ;
+	void (*dtor)(void *obj);
+	void *objs[OBJCACHE_MAX];
+	unsigned i, j, k, n, total;
+
+	total = 0;
+	for (k = 0; ; k++) {
+		/*
+		 * Empty each CPU's part of the k-th cache and then its
+		 * depot (j == MAXCPUS), each time running the destructors
+		 * with no spinlock held; they kfree, which may need to
+		 * flush TLBs.
+		 */
+		for (j = 0; j <= MAXCPUS; j++) {
+			spinlock_acquire(&objcache_listlock);
+			oc = objcache_list;
+			for (i=0; i<k && oc != NULL; i++) {
+				oc = oc->oc_next;
+			}
+			if (oc == NULL) {
+				spinlock_release(&objcache_listlock);
+				return total;
+			}
+			n = 0;
+			if (j < MAXCPUS) {
+				occ = &oc->oc_cpus[j];
+				spinlock_acquire(&occ->occ_lock);
+				while (occ->occ_count > 0) {
+					objs[n++] =
+					    occ->occ_objs[--occ->occ_count];
+				}
+				spinlock_release(&occ->occ_lock);
+			}
+			spinlock_acquire(&oc->oc_lock);
+			if (j == MAXCPUS) {
+				while (oc->oc_count > 0) {
+					objs[n++] = oc->oc_free[--oc->oc_count];
+				}
+			}
+			oc->oc_destructs += n;
+			dtor = oc->oc_dtor;
+			spinlock_release(&oc->oc_lock);
+			spinlock_release(&objcache_listlock);
+
+			for (i=0; i<n; i++) {
+				if (dtor != NULL) {
+					dtor(objs[i]);
+				}
+				kfree(objs[i]);
+			}
+			total += n;
+		}
+	}
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	struct objcache_cpu *occ;
+	unsigned i, cached, hits;
+	int inuse;
+
+	spinlock_acquire(&objcache_listlock);
+	for (oc = objcache_list; oc != NULL; oc = oc->oc_next) {
+		inuse = 0;
+		cached = 0;
+		hits = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			occ = &oc->oc_cpus[i];
+			spinlock_acquire(&occ->occ_lock);
+			inuse += occ->occ_inuse;
+			cached += occ->occ_count;
+			hits += occ->occ_hits;
+			spinlock_release(&occ->occ_lock);
+		}
+		spinlock_acquire(&oc->oc_lock);
+		kprintf("%-10s %4zu bytes: %d in use, %u cached, "
+			"%u reused, %u made, %u destroyed\n",
+			oc->oc_name, oc->oc_size, inuse,
+			cached + oc->oc_count, hits, oc->oc_constructs,
+			oc->oc_destructs);
+		spinlock_release(&oc->oc_lock);
+	}
+	spinlock_release(&objcache_listlock);
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/*
+ * Page cache for mapped files. See pagecache.h.
+ */
+
+#define PC_NBUCKETS 64
+
+struct pcpage {
+	struct vnode *pp_vnode;		/* file, referenced by us */
+	off_t pp_offset;		/* page aligned offset in the file */
+	paddr_t pp_frame;		/* 0 until read in */
+	unsigned pp_mappings;		/* page table entries using it */
+	bool pp_busy;			/* being read in or written back */
+	bool pp_dirty;			/* written to through a mapping */
+	bool pp_idle;			/* on pc_idle */
+	struct pcpage *pp_next;		/* hash chain */
+	struct pcpage *pp_idlenext;	/* pc_idle list */
+};
+
+/*
+ * pc_lock protects the table, the idle list, the statistics and every
+ * field of every page; pc_cv is signalled when a page stops being busy.
+ * No I/O is done with pc_lock held, and it may be taken with the
+ * paging lock held, never the other way round.
+ */
+static struct lock *pc_lock;
+static struct cv *pc_cv;
+static struct pcpage *pc_table[PC_NBUCKETS];
+static struct pcpage *pc_idle;		/* unmapped, waiting for reap */
+
+/* statistics */
+static unsigned pc_npages;
+static unsigned pc_hits;
+static unsigned pc_misses;
+static unsigned pc_writebacks;
+
+void
+pagecache_bootstrap(void)
+{
+	pc_lock = lock_create("pagecache");
+	pc_cv = cv_create("pagecache");
+	if (pc_lock == NULL || pc_cv == NULL) {
+		panic("pagecache: Out of memory\n");
+	}
+}
+
+static
+unsigned
+pc_hash(struct vnode *vn, off_t offset)
+{
+	return ((uintptr_t)vn / sizeof(void *) +
+		(unsigned)(offset / PAGE_SIZE)) % PC_NBUCKETS;
+}
+
+static
+struct pcpage *
+pc_find(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pp;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+	for (pp = pc_table[pc_hash(vn, offset)]; pp != NULL; pp = pp->pp_next) {
+		if (pp->pp_vnode == vn && pp->pp_offset == offset) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_remove(struct pcpage *pp)
+{
+	struct pcpage **pq;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+	pq = &pc_table[pc_hash(pp->pp_vnode, pp->pp_offset)];
+	while (*pq != pp) {
+		KASSERT(*pq != NULL);
+		pq = &(*pq)->pp_next;
+	}
+	*pq = pp->pp_next;
+	pc_npages--;
+}
+
+int
+pagecache_get(struct vnode *vn, off_t offset, paddr_t *frame)
+{
+	struct pcpage *pp;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t kvaddr;
+	unsigned bucket;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pc_lock);
+	while ((pp = pc_find(vn, offset)) != NULL && pp->pp_busy) {
+		cv_wait(pc_cv, pc_lock);
+	}
+	if (pp != NULL) {
+		/* if it's on the idle list, reap will leave it alone */
+		pp->pp_mappings++;
+		frame_share(pp->pp_frame);
+		pc_hits++;
+		*frame = pp->pp_frame;
+		lock_release(pc_lock);
+		return 0;
+	}
+
+	/* Enter it busy so nobody else reads it in at the same time */
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		lock_release(pc_lock);
+		return ENOMEM;
+	}
+	VOP_INCREF(vn);
+	pp->pp_vnode = vn;
+	pp->pp_offset = offset;
+	pp->pp_frame = 0;
+	pp->pp_mappings = 1;
+	pp->pp_busy = true;
+	pp->pp_dirty = false;
+	pp->pp_idle = false;
+	bucket = pc_hash(vn, offset);
+	pp->pp_next = pc_table[bucket];
+	pc_table[bucket] = pp;
+	pc_npages++;
+	pc_misses++;
+	lock_release(pc_lock);
+
+	kvaddr = vm_getpage();
+	if (kvaddr == 0) {
+		result = ENOMEM;
+		goto fail;
+	}
+	/* a short read at the end of the file leaves the rest zero */
+	bzero((void *)kvaddr, PAGE_SIZE);
+	uio_kinit(&iov, &ku, (void *)kvaddr, PAGE_SIZE, offset, UIO_READ);
+	result = VOP_READ(vn, &ku);
+	if (result) {
+		free_kpages(kvaddr);
+		goto fail;
+	}
+
+	lock_acquire(pc_lock);
+	pp->pp_frame = KVADDR_TO_PADDR(kvaddr);
+	pp->pp_busy = false;
+	/* the cache keeps the first reference, the caller gets this one */
+	frame_share(pp->pp_frame);
+	*frame = pp->pp_frame;
+	cv_broadcast(pc_cv, pc_lock);
+	lock_release(pc_lock);
+	return 0;
+
+ fail:
+	lock_acquire(pc_lock);
+	pc_remove(pp);
+	cv_broadcast(pc_cv, pc_lock);
+	lock_release(pc_lock);
+	VOP_DECREF(vn);
+	kfree(pp);
+	return result;
+}
+
+void
+pagecache_ref(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pp;
+
+	lock_acquire(pc_lock);
+	pp = pc_find(vn, offset);
+	KASSERT(pp != NULL && pp->pp_mappings > 0);
+	pp->pp_mappings++;
+	frame_share(pp->pp_frame);
+	lock_release(pc_lock);
+}
+
+void
+pagecache_put(struct vnode *vn, off_t offset, bool dirty)
+{
+	struct pcpage *pp;
+
+	lock_acquire(pc_lock);
+	pp = pc_find(vn, offset);
+	KASSERT(pp != NULL && pp->pp_mappings > 0);
+	if (dirty) {
+		pp->pp_dirty = true;
+	}
+	pp->pp_mappings--;
+	/* the cache still holds its own reference */
+	free_kpages(PADDR_TO_KVADDR(pp->pp_frame));
+	if (pp->pp_mappings == 0 && !pp->pp_idle) {
+		pp->pp_idle = true;
+		pp->pp_idlenext = pc_idle;
+		pc_idle = pp;
+	}
+	lock_release(pc_lock);
+}
+
+/*
+ * Write a dirty page back to its file, not past the end of the file;
+ * anything written there through a mapping is dropped.
+ */
+static
+void
+pc_writeback(struct pcpage *pp)
+{
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(pp->pp_vnode, &st);
+	if (result) {
+		goto fail;
+	}
+	if (st.st_size <= pp->pp_offset) {
+		return;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - pp->pp_offset < PAGE_SIZE) {
+		len = st.st_size - pp->pp_offset;
+	}
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pp->pp_frame), len,
+		  pp->pp_offset, UIO_WRITE);
+	result = VOP_WRITE(pp->pp_vnode, &ku);
+	if (result) {
+		goto fail;
+	}
+	return;
+
+ fail:
+	kprintf("pagecache: writeback at offset %llu: %s\n",
+		(unsigned long long)pp->pp_offset, strerror(result));
+}
+
+void
+pagecache_reap(void)
+{
+	struct pcpage *pp;
+
+	lock_acquire(pc_lock);
+	while ((pp = pc_idle) != NULL) {
+		pc_idle = pp->pp_idlenext;
+		pp->pp_idle = false;
+		if (pp->pp_mappings > 0) {
+			/* mapped again since */
+			continue;
+		}
+
+		/* keep it in the table so pagecache_get waits for us */
+		pp->pp_busy = true;
+		if (pp->pp_dirty) {
+			pc_writebacks++;
+			lock_release(pc_lock);
+			pc_writeback(pp);
+			lock_acquire(pc_lock);
+		}
+		pc_remove(pp);
+		cv_broadcast(pc_cv, pc_lock);
+		lock_release(pc_lock);
+
+		free_kpages(PADDR_TO_KVADDR(pp->pp_frame));
+		VOP_DECREF(pp->pp_vnode);
+		kfree(pp);
+		lock_acquire(pc_lock);
+	}
+	lock_release(pc_lock);
+}
+
+void
+pagecache_printstats(void)
+{
+	lock_acquire(pc_lock);
+	kprintf("Page cache: %u pages, %u hits, %u misses, %u writebacks\n",
+		pc_npages, pc_hits, pc_misses, pc_writebacks);
+	lock_release(pc_lock);
+}
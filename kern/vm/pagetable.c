@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <platform/maxcpus.h>
+
+#include "opt-hashpt.h"
+
+/*
+ * Page tables. Each address space maps user pages to page table
+ * entries (see addrspace.h for their format). There are two
+ * implementations, selected with "options hashpt" in the kernel
+ * config:
+ *
+ *    two-level - the default. An 8K first level of PT_FIRST_SIZE
+ *                pointers to 2K second level tables of PT_SECOND_SIZE
+ *                entries, allocated when first used.
+ *
+ *    hashed    - a chained hash table keyed by virtual page number,
+ *                one per address space. It starts at HPT_MINBUCKETS
+ *                buckets and doubles when the chains average more
+ *                than HPT_LOAD entries, so a small process costs a
+ *                few hundred bytes instead of 10K.
+ *
+ * Each page table is protected by its address space's page table
+ * lock. The statistics are kept per CPU, so that lookups from
+ * different address spaces share nothing; each CPU only changes its
+ * own, at splhigh, and pt_printstats adds them up.
+ */
+
+/* page table statistics */
+static struct pt_stats {
+	int ps_bytes;			/* memory held by page tables */
+	unsigned ps_lookups;		/* lookup_pt/insert_pt calls */
+	unsigned ps_probes;		/* table entries examined by them */
+} pt_stats[MAXCPUS];
+
+static
+void
+pt_count(int bytes, unsigned lookups, unsigned probes)
+{
+	struct pt_stats *ps;
+	int spl;
+
+	spl = splhigh();
+	ps = &pt_stats[curcpu->c_number];
+	ps->ps_bytes += bytes;
+	ps->ps_lookups += lookups;
+	ps->ps_probes += probes;
+	splx(spl);
+}
+
+#if OPT_HASHPT
+
+#define HPT_MINBUCKETS 16
+#define HPT_LOAD 2
+
+struct hpt_entry {
+	vaddr_t he_page;
+	paddr_t he_pte;
+	struct hpt_entry *he_next;
+};
+
+struct pagetable {
+	struct hpt_entry **pt_buckets;
+	unsigned pt_nbuckets;		/* a power of two */
+	unsigned pt_count;		/* entries in the table */
+};
+
+static
+unsigned
+hpt_hash(struct pagetable *pt, vaddr_t page)
+{
+	/* Fibonacci hashing of the page number */
+	return ((page >> 12) * 2654435761U) & (pt->pt_nbuckets - 1);
+}
+
+static
+struct hpt_entry **
+hpt_alloc_buckets(unsigned nbuckets)
+{
+	struct hpt_entry **buckets;
+	unsigned i;
+
+	buckets = kmalloc(nbuckets * sizeof(struct hpt_entry *));
+	if (buckets == NULL) {
+		return NULL;
+	}
+	for (i=0; i<nbuckets; i++) {
+		buckets[i] = NULL;
+	}
+	pt_count(nbuckets * sizeof(struct hpt_entry *), 0, 0);
+	return buckets;
+}
+
+static
+void
+hpt_free_buckets(struct hpt_entry **buckets, unsigned nbuckets)
+{
+	kfree(buckets);
+	pt_count(-(int)(nbuckets * sizeof(struct hpt_entry *)), 0, 0);
+}
+
+/*
+ * Double the number of buckets. Failing to is harmless, the chains
+ * just get longer.
+ */
+static
+void
+hpt_grow(struct pagetable *pt)
+{
+	struct hpt_entry **old, *he;
+	unsigned oldn, i, h;
+
+	old = pt->pt_buckets;
+	oldn = pt->pt_nbuckets;
+	pt->pt_buckets = hpt_alloc_buckets(oldn * 2);
+	if (pt->pt_buckets == NULL) {
+		pt->pt_buckets = old;
+		return;
+	}
+	pt->pt_nbuckets = oldn * 2;
+
+	for (i=0; i<oldn; i++) {
+		while (old[i] != NULL) {
+			he = old[i];
+			old[i] = he->he_next;
+			h = hpt_hash(pt, he->he_page);
+			he->he_next = pt->pt_buckets[h];
+			pt->pt_buckets[h] = he;
+		}
+	}
+	hpt_free_buckets(old, oldn);
+}
+
+static
+struct hpt_entry *
+hpt_find(struct pagetable *pt, vaddr_t page)
+{
+	struct hpt_entry *he;
+	unsigned probes = 0;
+
+	for (he = pt->pt_buckets[hpt_hash(pt, page)]; he != NULL;
+	     he = he->he_next) {
+		probes++;
+		if (he->he_page == page) {
+			break;
+		}
+	}
+	pt_count(0, 1, probes);
+	return he;
+}
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	pt->pt_buckets = hpt_alloc_buckets(HPT_MINBUCKETS);
+	if (pt->pt_buckets == NULL) {
+		kfree(pt);
+		return NULL;
+	}
+	pt->pt_nbuckets = HPT_MINBUCKETS;
+	pt->pt_count = 0;
+	pt_count(sizeof(struct pagetable), 0, 0);
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	struct hpt_entry *he;
+	unsigned i;
+
+	for (i=0; i<pt->pt_nbuckets; i++) {
+		while (pt->pt_buckets[i] != NULL) {
+			he = pt->pt_buckets[i];
+			pt->pt_buckets[i] = he->he_next;
+			kfree(he);
+		}
+	}
+	pt_count(-(int)(pt->pt_count * sizeof(struct hpt_entry)), 0, 0);
+	hpt_free_buckets(pt->pt_buckets, pt->pt_nbuckets);
+	kfree(pt);
+	pt_count(-(int)sizeof(struct pagetable), 0, 0);
+}
+
+paddr_t
+lookup_pt(vaddr_t page, struct addrspace *as)
+{
+	struct hpt_entry *he;
+
+	he = hpt_find(as->pagetable, page & PAGE_FRAME);
+	return he == NULL ? 0 : he->he_pte;
+}
+
+int
+insert_pt(vaddr_t page, paddr_t pte, struct addrspace *as)
+{
+	struct pagetable *pt = as->pagetable;
+	struct hpt_entry *he;
+	unsigned h;
+
+	page &= PAGE_FRAME;
+	he = hpt_find(pt, page);
+	if (he != NULL) {
+		/* cleared entries stay until pt_reclaim, see pt_foreach */
+		he->he_pte = pte;
+		return 0;
+	}
+	if (pte == 0) {
+		return 0;
+	}
+
+	he = kmalloc(sizeof(struct hpt_entry));
+	if (he == NULL) {
+		return ENOMEM;
+	}
+	he->he_page = page;
+	he->he_pte = pte;
+	h = hpt_hash(pt, page);
+	he->he_next = pt->pt_buckets[h];
+	pt->pt_buckets[h] = he;
+	pt->pt_count++;
+	pt_count(sizeof(struct hpt_entry), 0, 0);
+
+	if (pt->pt_count > pt->pt_nbuckets * HPT_LOAD) {
+		hpt_grow(pt);
+	}
+	return 0;
+}
+
+int
+pt_foreach(struct addrspace *as, pt_visit_fn fn, void *data)
+{
+	struct pagetable *pt = as->pagetable;
+	struct hpt_entry *he;
+	unsigned i;
+	int result;
+
+	for (i=0; i<pt->pt_nbuckets; i++) {
+		for (he = pt->pt_buckets[i]; he != NULL; he = he->he_next) {
+			if (he->he_pte == 0) {
+				continue;
+			}
+			result = fn(he->he_page, he->he_pte, data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Unlink and free the cleared entries for pages from START up to END
+ * on the chain at PP. Returns how many went.
+ */
+static
+unsigned
+hpt_reclaim_chain(struct hpt_entry **pp, vaddr_t start, vaddr_t end)
+{
+	struct hpt_entry *he;
+	unsigned freed = 0;
+
+	while (*pp != NULL) {
+		he = *pp;
+		if (he->he_pte == 0 && he->he_page >= start &&
+		    he->he_page < end) {
+			*pp = he->he_next;
+			kfree(he);
+			freed++;
+		}
+		else {
+			pp = &he->he_next;
+		}
+	}
+	return freed;
+}
+
+void
+pt_reclaim(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct pagetable *pt = as->pagetable;
+	vaddr_t page;
+	unsigned i, freed;
+
+	freed = 0;
+	if ((end - start) / PAGE_SIZE <= pt->pt_nbuckets) {
+		/* few pages, just look at their own chains */
+		for (page = start; page < end; page += PAGE_SIZE) {
+			i = hpt_hash(pt, page);
+			freed += hpt_reclaim_chain(&pt->pt_buckets[i],
+						   page, page + PAGE_SIZE);
+		}
+	}
+	else {
+		for (i=0; i<pt->pt_nbuckets; i++) {
+			freed += hpt_reclaim_chain(&pt->pt_buckets[i],
+						   start, end);
+		}
+	}
+	pt->pt_count -= freed;
+	pt_count(-(int)(freed * sizeof(struct hpt_entry)), 0, 0);
+}
+
+#else /* OPT_HASHPT */
+
+/* First level index is the top 11 bits, second level the next 9 */
+#define PT_FIRST_INDEX(page) ((page) >> 21)
+#define PT_SECOND_INDEX(page) (((page) << 11) >> 23)
+
+struct pagetable {
+	paddr_t *pt_first[PT_FIRST_SIZE];
+};
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	int i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_FIRST_SIZE; i++) {
+		pt->pt_first[i] = NULL;
+	}
+	pt_count(sizeof(struct pagetable), 0, 0);
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	int i;
+
+	for (i=0; i<PT_FIRST_SIZE; i++) {
+		if (pt->pt_first[i] != NULL) {
+			kfree(pt->pt_first[i]);
+			pt_count(-(int)(PT_SECOND_SIZE * sizeof(paddr_t)),
+				 0, 0);
+		}
+	}
+	kfree(pt);
+	pt_count(-(int)sizeof(struct pagetable), 0, 0);
+}
+
+paddr_t
+lookup_pt(vaddr_t page, struct addrspace *as)
+{
+	paddr_t *second;
+
+	pt_count(0, 1, 1);
+	second = as->pagetable->pt_first[PT_FIRST_INDEX(page)];
+	if (second == NULL) {
+		return 0;
+	}
+	return second[PT_SECOND_INDEX(page)];
+}
+
+int
+insert_pt(vaddr_t page, paddr_t pte, struct addrspace *as)
+{
+	paddr_t **first = &as->pagetable->pt_first[PT_FIRST_INDEX(page)];
+	int i;
+
+	pt_count(0, 1, 1);
+	if (*first == NULL) {
+		if (pte == 0) {
+			return 0;
+		}
+		*first = kmalloc(PT_SECOND_SIZE * sizeof(paddr_t));
+		if (*first == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<PT_SECOND_SIZE; i++) {
+			(*first)[i] = 0;
+		}
+		pt_count(PT_SECOND_SIZE * sizeof(paddr_t), 0, 0);
+	}
+	(*first)[PT_SECOND_INDEX(page)] = pte;
+	return 0;
+}
+
+int
+pt_foreach(struct addrspace *as, pt_visit_fn fn, void *data)
+{
+	struct pagetable *pt = as->pagetable;
+	paddr_t pte;
+	int i, j, result;
+
+	for (i=0; i<PT_FIRST_SIZE; i++) {
+		if (pt->pt_first[i] == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_SECOND_SIZE; j++) {
+			pte = pt->pt_first[i][j];
+			if (pte == 0) {
+				continue;
+			}
+			result = fn(((vaddr_t)i << 21) | ((vaddr_t)j << 12),
+				    pte, data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+void
+pt_reclaim(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct pagetable *pt = as->pagetable;
+	vaddr_t first, last;
+	unsigned i, j;
+
+	if (start >= end) {
+		return;
+	}
+	first = PT_FIRST_INDEX(start);
+	last = PT_FIRST_INDEX(end - 1);
+	for (i=first; i<=last; i++) {
+		if (pt->pt_first[i] == NULL) {
+			continue;
+		}
+		/* only second level tables with nothing left in them */
+		for (j=0; j<PT_SECOND_SIZE; j++) {
+			if (pt->pt_first[i][j] != 0) {
+				break;
+			}
+		}
+		if (j < PT_SECOND_SIZE) {
+			continue;
+		}
+		kfree(pt->pt_first[i]);
+		pt->pt_first[i] = NULL;
+		pt_count(-(int)(PT_SECOND_SIZE * sizeof(paddr_t)), 0, 0);
+	}
+}
+
+#endif /* OPT_HASHPT */
+
+void
+pt_printstats(void)
+{
+	unsigned i, lookups, probes;
+	int bytes;
+
+	/* a snapshot; each CPU may be changing its own meanwhile */
+	bytes = 0;
+	lookups = 0;
+	probes = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		bytes += pt_stats[i].ps_bytes;
+		lookups += pt_stats[i].ps_lookups;
+		probes += pt_stats[i].ps_probes;
+	}
+
+	kprintf("Page tables (%s): %d bytes, %u lookups, %u probes\n",
+		OPT_HASHPT ? "hashed" : "two-level", bytes, lookups, probes);
+}
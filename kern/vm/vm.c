@@ -2,17 +2,138 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
+#include <synch.h>
+#include <wchan.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
+#include <swap.h>
+#include <pagecache.h>
 #include <machine/tlb.h>
 #include <current.h>
 #include <proc.h>
 #include <spl.h>
+#include <cpu.h>
+#include <copyinout.h>
+#include <platform/maxcpus.h>
 
 /* Place your page table functions here */
-int insert_pt(vaddr_t page, paddr_t frame, struct addrspace *as);
 int check_valid_region(vaddr_t page, struct addrspace *as);
-paddr_t lookup_pt(uint32_t page, struct addrspace *as);
+int copy_on_write(vaddr_t page, paddr_t pte, struct addrspace *as, paddr_t *ret);
+
+/*
+ * Locking. Each address space's page table has its own lock
+ * (as->pt_lock), held for every read or change of an entry and every
+ * TLB load made from one, so a fault on a page that is mapped already
+ * takes nothing else, and neither does the first touch of an anonymous
+ * page while there is free memory above the kernel reserve. Anything
+ * that may have to evict a page of another address space to get a
+ * frame takes the paging lock vm_lock first; eviction then takes the
+ * victim's page table lock as well. Neither is held across swap I/O:
+ * a page on its way to or from swap has PTE_TRANSIT set, as->transit
+ * counts them, and anything that needs the entry sleeps on
+ * vm_transit_cv until it has arrived.
+ */
+static struct lock *vm_lock;
+static struct cv *vm_transit_cv;
+
+/* paging statistics, protected by vm_lock */
+static unsigned vm_evictions;
+static unsigned vm_discards;     // of those, clean file pages just dropped
+static unsigned vm_dirtied;      // first writes to clean pages
+static unsigned vm_pageins;
+static unsigned vm_fileloads;    // pages of PRIVATE regions read in
+static unsigned vm_stackgrows;   // faults that grew a stack
+
+/*
+ * Pool of pages zeroed ahead of time by the pagezero thread, so that
+ * first-touch faults don't bzero on the fault path. The thread tops
+ * the pool up to ZERO_POOL_SIZE once it has drained below
+ * ZERO_POOL_LOW, and only while at least 1/ZERO_POOL_RESERVE of
+ * memory is free so it never pushes user pages out to swap.
+ */
+#define ZERO_POOL_SIZE 32
+#define ZERO_POOL_LOW 16
+#define ZERO_POOL_RESERVE 8
+
+static struct lock *zero_lock;
+static struct cv *zero_cv;
+static vaddr_t zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_count;
+// zero pool statistics, protected by zero_lock
+static unsigned zero_hits;
+static unsigned zero_misses;
+
+/*
+ * The pagezero thread only zeroes while its CPU has nothing else to
+ * run. Otherwise it sleeps on zero_idle_wchan with zero_idle_cpu set
+ * to its CPU, and the idle loop there wakes it through vm_idle.
+ */
+static struct spinlock zero_idle_lock = SPINLOCK_INITIALIZER;
+static struct wchan *zero_idle_wchan;
+static struct cpu *zero_idle_cpu;
+
+static void vm_zerothread(void *data1, unsigned long data2);
+
+/*
+ * The zero frame. A read of a page nobody has written yet maps this
+ * one frame read-only instead of a zeroed frame of its own; the first
+ * write gets a private frame through copy_on_write. It is never freed
+ * and mappings of it aren't counted in its reference count.
+ */
+static paddr_t vm_zeroframe;
+
+/*
+ * TLB address space IDs. Each address space gets one of the
+ * NUM_TLBPID hardware PIDs the first time it runs in a generation, so
+ * its TLB entries survive switching to other processes and back.
+ * When they run out a new generation starts; every CPU flushes its
+ * TLB the next time it activates an address space and all address
+ * spaces get new IDs as they run. Generation 0 is never current, so
+ * new address spaces start without an ID.
+ */
+static struct spinlock asid_spinlock = SPINLOCK_INITIALIZER;
+// as->cpus has a bit for each CPU that ran the address space
+#if MAXCPUS > 32
+#error "as->cpus is too small for MAXCPUS"
+#endif
+static unsigned asid_next = NUM_TLBPID;   // next free PID, none left yet
+static unsigned asid_generation = 0;
+// TLB statistics, protected by asid_spinlock
+static unsigned tlb_flushes;     // whole TLB thrown away
+static unsigned tlb_rollovers;   // ASID generations started
+
+/*
+ * Fault statistics, kept per CPU so faults don't share a counter.
+ * Only changed at splhigh by the CPU they belong to.
+ */
+static struct vm_cpustats {
+    unsigned vc_faults;          // faults that loaded the TLB
+    unsigned vc_refills;         // of those, on pages mapped already
+    unsigned vc_prefilled;       // TLB entries loaded ahead of a fault
+    unsigned vc_zeroahead;       // pages allocated ahead of a fault
+    unsigned vc_zeromaps;        // pages mapped to the zero frame
+    unsigned vc_zerocopies;      // of those, written to later
+} vm_cpustats[MAXCPUS];
+
+#define VM_CPUSTAT_INC(field) do {                      \
+        int spl_ = splhigh();                           \
+        vm_cpustats[curcpu->c_number].field++;          \
+        splx(spl_);                                     \
+    } while(0)
+
+/*
+ * Fault-around. A fault also loads the TLB with the other resident
+ * pages of the same region in the aligned window of vm_faultaround
+ * pages around it. When first-touch faults walk up a region a page
+ * at a time, the rest of the window is allocated and zeroed ahead as
+ * well, as long as that needs no paging. Set and counted under
+ * vm_lock; faults that page nothing read vm_faultaround without it.
+ */
+#define FAULTAROUND_MAX (NUM_TLB / 4)
+static unsigned vm_faultaround = 8;
+static unsigned vm_prefaulted;   // pages read ahead or for MADV_WILLNEED
 
 void vm_bootstrap(void)
 {
@@ -21,19 +142,1140 @@ void vm_bootstrap(void)
      * You may or may not need to add anything here depending what's
      * provided or required by the assignment spec.
      */
+    vm_lock = lock_create("vm");
+    vm_transit_cv = cv_create("vmtransit");
+    if(vm_lock == NULL || vm_transit_cv == NULL){
+        panic("vm_bootstrap: Out of memory creating paging lock\n");
+    }
+    swap_bootstrap();
+    pagecache_bootstrap();
+    as_bootstrap();
+    vmalloc_bootstrap();
+
+    vaddr_t zeropage = alloc_kpages(1);
+    if(zeropage == 0){
+        panic("vm_bootstrap: Out of memory allocating the zero frame\n");
+    }
+    bzero((void *) zeropage, PAGE_SIZE);
+    vm_zeroframe = KVADDR_TO_PADDR(zeropage);
+
+    zero_lock = lock_create("zeropool");
+    zero_cv = cv_create("zeropool");
+    zero_idle_wchan = wchan_create("zeroidle");
+    if(zero_lock == NULL || zero_cv == NULL || zero_idle_wchan == NULL){
+        panic("vm_bootstrap: Out of memory creating zero pool\n");
+    }
+    int err = thread_fork("pagezero", NULL, vm_zerothread, NULL, 0);
+    if(err){
+        panic("vm_bootstrap: thread_fork pagezero: %s\n", strerror(err));
+    }
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+void vm_paging_lock(struct addrspace *as)
+{
+    lock_acquire(vm_lock);
+    if(as != NULL){
+        lock_acquire(as->pt_lock);
+    }
+}
+
+void vm_paging_unlock(struct addrspace *as)
+{
+    if(as != NULL){
+        lock_release(as->pt_lock);
+    }
+    lock_release(vm_lock);
+}
+
+// Sleep until some page on its way to or from swap gets there. Call
+// with the paging lock held for AS; it is dropped while asleep.
+static void vm_transit_sleep(struct addrspace *as)
+{
+    lock_release(as->pt_lock);
+    cv_wait(vm_transit_cv, vm_lock);
+    lock_acquire(as->pt_lock);
+}
+
+void vm_wait_transit(struct addrspace *as)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT(lock_do_i_hold(as->pt_lock));
+    while(as->transit > 0){
+        vm_transit_sleep(as);
+    }
+}
+
+// A page of AS is done moving to or from swap
+static void vm_transit_done(struct addrspace *as)
+{
+    KASSERT(as->transit > 0);
+    as->transit--;
+    cv_broadcast(vm_transit_cv, vm_lock);
+}
+
+void vm_pte_share(paddr_t pte)
+{
+    if(PTE_FRAME(pte) != vm_zeroframe){
+        frame_share(PTE_FRAME(pte));
+    }
+}
+
+void vm_pte_release(paddr_t pte)
+{
+    // drops one reference if the frame is shared
+    if(PTE_FRAME(pte) != vm_zeroframe){
+        free_kpages(PADDR_TO_KVADDR(PTE_FRAME(pte)));
+    }
+}
+
+// Throw away this CPU's whole TLB. Call at splhigh.
+static void tlb_flush_all(void)
+{
+    for (int i=0; i<NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_setpid(curcpu->c_tlbpid);
+}
+
+void vm_tlb_activate(struct addrspace *as)
+{
+    int spl = splhigh();
+    // Still loaded here (e.g. back from a kernel thread or another
+    // thread of the same process) and its entries are still valid
+    if(as == curcpu->c_tlbas && as->asid_gen == curcpu->c_tlbgen){
+        curcpu->c_tlbkept++;
+        splx(spl);
+        return;
+    }
+    spinlock_acquire(&asid_spinlock);
+    if(as->asid_gen != asid_generation){
+        if(asid_next == NUM_TLBPID){
+            // out of IDs, start over in a new generation
+            asid_generation++;
+            asid_next = 0;
+            tlb_rollovers++;
+        }
+        as->asid = asid_next++;
+        as->asid_gen = asid_generation;
+        // no TLB holds entries for the new ID yet
+        as->cpus = 0;
+    }
+    KASSERT(curcpu->c_number < MAXCPUS);
+    as->cpus |= (uint32_t)1 << curcpu->c_number;
+    bool flush = curcpu->c_tlbgen != asid_generation;
+    if(flush){
+        tlb_flushes++;
+    }
+    curcpu->c_tlbgen = asid_generation;
+    // the one leaving loads nothing more here, see tlb_shootdown_cpus
+    struct addrspace *old = curcpu->c_tlbas;
+    if(old != NULL && old != as){
+        old->tlbswept[curcpu->c_number] = curcpu->c_tlbswept;
+    }
+    curcpu->c_tlbas = as;
+    spinlock_release(&asid_spinlock);
+
+    curcpu->c_tlbpid = as->asid;
+    if(flush){
+        // entries from the old generation may carry reused IDs
+        tlb_flush_all();
+    }
+    else{
+        tlb_setpid(as->asid);
+    }
+    splx(spl);
+}
+
+/*
+ * TLB shootdown. An address space's entries can be in the TLB of every
+ * CPU it has run on in its ASID generation (as->cpus), not only the
+ * one running it now. Taking a page away drops it here and sends each
+ * of the other CPUs one IPI for the whole batch, then waits for them
+ * all. Senders hold the address space's page table lock, so nothing
+ * can load the old entries again meanwhile, and nothing else: any
+ * number of shootdowns can be in flight, and they wait with interrupts
+ * on so CPUs waiting on each other still take each other's IPIs.
+ *
+ * A CPU the address space has stopped running on loses its entries to
+ * vm_tlbsweep over time. Each CPU counts the TLB slots its sweep has
+ * cleared (c_tlbswept), and an address space notes the count when a
+ * CPU switches away from it (as->tlbswept); once the sweep has been
+ * round the whole TLB since, that CPU holds nothing and drops out of
+ * as->cpus.
+ */
+struct tlbshootdown_wait {
+    struct spinlock tw_lock;
+    unsigned tw_pending;         // targets that haven't done it yet
+};
+// shootdown statistics, protected by asid_spinlock
+static unsigned tlb_shootdowns;  // batches that had other CPUs to tell
+static unsigned tlb_shootipis;   // IPIs sent for them
+static unsigned tlb_shootskips;  // CPUs left out, swept since AS ran
+
+// Drop the entries for the pages of a shootdown (all of its address
+// space's if it has none, or every kseg2 entry for a kernel one) from
+// this CPU's TLB. Call at splhigh.
+static void tlb_drop(const struct tlbshootdown *ts)
+{
+    if(ts->ts_kernel){
+        // vmalloc's entries are global, so go by address
+        for (int i=0; i<NUM_TLB; i++) {
+            uint32_t hi, lo;
+            tlb_read(&hi, &lo, i);
+            if((lo & TLBLO_VALID) && (hi & TLBHI_VPAGE) >= MIPS_KSEG2){
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+        tlb_setpid(curcpu->c_tlbpid);
+        return;
+    }
+    // entries from another generation were flushed already
+    if(ts->ts_gen == 0 || ts->ts_gen != curcpu->c_tlbgen){
+        return;
+    }
+    uint32_t pid = ts->ts_asid << TLBHI_PIDSHIFT;
+    if(ts->ts_npages == 0){
+        for (int i=0; i<NUM_TLB; i++) {
+            uint32_t hi, lo;
+            tlb_read(&hi, &lo, i);
+            if((lo & TLBLO_VALID) && (hi & TLBHI_PID) == pid){
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+    }
+    for(unsigned i = 0; i < ts->ts_npages; i++){
+        int index = tlb_probe((ts->ts_pages[i] & TLBHI_VPAGE) | pid, 0);
+        if(index >= 0){
+            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        }
+    }
+    tlb_setpid(curcpu->c_tlbpid);
+}
+
+// Hand TS to every CPU in CPUS and wait until they have all done it,
+// with interrupts on. Returns the number of IPIs sent.
+static unsigned tlb_shootdown_send(struct tlbshootdown *ts, uint32_t cpus)
+{
+    struct tlbshootdown_wait wait;
+    unsigned sent = 0;
+
+    KASSERT(curthread->t_in_interrupt == false);
+    KASSERT(curcpu->c_spinlocks == 0);
+    spinlock_init(&wait.tw_lock);
+    wait.tw_pending = 0;
+    ts->ts_wait = &wait;
+    for(unsigned n = 0; cpus != 0; n++, cpus >>= 1){
+        if(cpus & 1){
+            spinlock_acquire(&wait.tw_lock);
+            wait.tw_pending++;
+            spinlock_release(&wait.tw_lock);
+            ipi_tlbshootdown(cpu_get(n), ts);
+            sent++;
+        }
+    }
+    bool done;
+    do{
+        spinlock_acquire(&wait.tw_lock);
+        done = wait.tw_pending == 0;
+        spinlock_release(&wait.tw_lock);
+    } while(!done);
+    spinlock_cleanup(&wait.tw_lock);
+    return sent;
+}
+
+// The CPUs that may still hold entries of AS, leaving out (for good)
+// the ones whose sweep has cleared the whole TLB since AS last ran
+// there. Call with asid_spinlock held.
+static uint32_t tlb_shootdown_cpus(struct addrspace *as)
+{
+    uint32_t cpus = as->cpus;
+    for(unsigned n = 0; n < MAXCPUS; n++){
+        if(!(cpus & ((uint32_t)1 << n))){
+            continue;
+        }
+        struct cpu *c = cpu_get(n);
+        if(c->c_tlbas != as &&
+           c->c_tlbswept - as->tlbswept[n] >= NUM_TLB){
+            cpus &= ~((uint32_t)1 << n);
+            tlb_shootskips++;
+        }
+    }
+    as->cpus = cpus;
+    return cpus;
+}
+
+// Drop NPAGES PAGES of AS (all of them if NPAGES is 0) from every TLB
+// that may hold them
+static void tlb_shootdown(struct addrspace *as, const vaddr_t *pages,
+                          unsigned npages)
+{
+    struct tlbshootdown ts;
+    uint32_t cpus;
+
+    KASSERT(lock_do_i_hold(as->pt_lock));
+    KASSERT(npages <= TLBSHOOTDOWN_PAGES);
+    spinlock_acquire(&asid_spinlock);
+    ts.ts_asid = as->asid;
+    ts.ts_gen = as->asid_gen;
+    // never ran, so no TLB has anything of it
+    cpus = ts.ts_gen != 0 ? tlb_shootdown_cpus(as) : 0;
+    spinlock_release(&asid_spinlock);
+    ts.ts_kernel = false;
+    ts.ts_npages = npages;
+    for(unsigned i = 0; i < npages; i++){
+        ts.ts_pages[i] = pages[i];
+    }
+
+    int spl = splhigh();
+    tlb_drop(&ts);
+    cpus &= ~((uint32_t)1 << curcpu->c_number);
+    splx(spl);
+    if(cpus != 0){
+        unsigned sent = tlb_shootdown_send(&ts, cpus);
+        spinlock_acquire(&asid_spinlock);
+        tlb_shootdowns++;
+        tlb_shootipis += sent;
+        spinlock_release(&asid_spinlock);
+    }
+}
+
+void vm_tlb_flush_kernel(uint32_t cpus)
+{
+    struct tlbshootdown ts;
+
+    ts.ts_kernel = true;
+    ts.ts_asid = 0;
+    ts.ts_gen = 0;
+    ts.ts_npages = 0;
+
+    int spl = splhigh();
+    tlb_drop(&ts);
+    cpus &= ~((uint32_t)1 << curcpu->c_number);
+    splx(spl);
+    if(cpus != 0){
+        tlb_shootdown_send(&ts, cpus);
+    }
+}
+
+void vm_tlb_release(struct addrspace *as)
+{
+    spinlock_acquire(&asid_spinlock);
+    for(unsigned i = 0; i < cpu_count(); i++){
+        struct cpu *c = cpu_get(i);
+        if(c->c_tlbas == as){
+            c->c_tlbas = NULL;
+        }
+    }
+    spinlock_release(&asid_spinlock);
+}
+
+void vm_tlb_flush_as(struct addrspace *as)
+{
+    tlb_shootdown(as, NULL, 0);
+}
+
+void vm_tlb_invalidate(vaddr_t page, struct addrspace *as)
+{
+    tlb_shootdown(as, &page, 1);
+}
+
+// Give up what an unmapped page table entry held in REGION
+static void vm_unmap_release(struct region *region, vaddr_t page,
+                             paddr_t pte)
+{
+    if(REGION_CACHED(region)){
+        pagecache_put(region->vnode, REGION_FILEOFF(region, page),
+                      pte & PTE_DIRTY);
+        return;
+    }
+    vm_pte_release(pte);
+}
+
+// Unmapping more pages than this flushes the address space's TLB
+// entries in one pass instead of probing for each page; anything
+// smaller goes out as one shootdown batch
+#define UNMAP_FLUSH_PAGES TLBSHOOTDOWN_PAGES
+
+void vm_unmap(struct addrspace *as, struct region *region,
+              vaddr_t start, vaddr_t end)
+{
+    vaddr_t pages[UNMAP_FLUSH_PAGES];
+    paddr_t ptes[UNMAP_FLUSH_PAGES];
+    unsigned npages = 0;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT(lock_do_i_hold(as->pt_lock));
+    // pages on their way out to swap are the evictor's until they land
+    vm_wait_transit(as);
+    // nothing can load the entries again while we hold the lock, so
+    // a big range can be flushed once before any frame is freed
+    bool bulk = (end - start) / PAGE_SIZE > UNMAP_FLUSH_PAGES;
+    if(bulk){
+        vm_tlb_flush_as(as);
+    }
+    for(vaddr_t page = start; page < end; page += PAGE_SIZE){
+        paddr_t pte = lookup_pt(page, as);
+        if(pte == 0){
+            continue;
+        }
+        insert_pt(page, 0, as);
+        if(pte & PTE_SWAPPED){
+            swap_free(PTE_SWAPSLOT(pte));
+            continue;
+        }
+        if(bulk){
+            vm_unmap_release(region, page, pte);
+            continue;
+        }
+        // the frames stay until no TLB can reach them
+        pages[npages] = page;
+        ptes[npages] = pte;
+        npages++;
+    }
+    if(npages > 0){
+        tlb_shootdown(as, pages, npages);
+    }
+    for(unsigned i = 0; i < npages; i++){
+        vm_unmap_release(region, pages[i], ptes[i]);
+    }
+    // so sbrk, munmap and MADV_DONTNEED churn doesn't grow the table
+    pt_reclaim(as, start, end);
+}
+
+// Push one user frame out to swap to make room. HELD is the address
+// space whose page table lock the caller holds, if any; both locks are
+// dropped while the page is written out. Returns ENOMEM when there is
+// no swap or nothing left that can be evicted.
+static int vm_evict(struct addrspace *held)
+{
+    paddr_t frame;
+    struct addrspace *as;
+    vaddr_t page;
+    unsigned slot;
+    paddr_t pte;
+    int ret;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    while(1){
+        ret = frame_choose_victim(&frame, &as, &page);
+        if(ret){
+            return ret;
+        }
+        if(as != held){
+            lock_acquire(as->pt_lock);
+        }
+        pte = lookup_pt(page, as);
+        if((pte & TLBLO_VALID) && PTE_FRAME(pte) == frame){
+            break;
+        }
+        // the owner no longer maps the frame here, forget it
+        frame_set_owner(frame, NULL, 0);
+        if(as != held){
+            lock_release(as->pt_lock);
+        }
+    }
+
+    // Read from its file and never written, so there's nothing to save;
+    // the next fault reads it again
+    if((pte & PTE_FILE) && !(pte & PTE_DIRTY)){
+        insert_pt(page, 0, as);
+        vm_tlb_invalidate(page, as);
+        if(as != held){
+            lock_release(as->pt_lock);
+        }
+        free_kpages(PADDR_TO_KVADDR(frame));
+        vm_evictions++;
+        vm_discards++;
+        return 0;
+    }
+    ret = swap_enabled() ? swap_alloc(&slot) : ENOMEM;
+    if(ret){
+        if(as != held){
+            lock_release(as->pt_lock);
+        }
+        return ENOMEM;
+    }
+    // unmap first; from now on the owner faults and waits for the write
+    insert_pt(page, MKPTE_SWAP(slot) | PTE_TRANSIT, as);
+    vm_tlb_invalidate(page, as);
+    frame_set_owner(frame, NULL, 0);
+    as->transit++;
+    if(as != held){
+        lock_release(as->pt_lock);
+    }
+
+    // nobody else waits on the disk
+    vm_paging_unlock(held);
+    ret = swap_out(slot, PADDR_TO_KVADDR(frame));
+    vm_paging_lock(held);
+
+    if(as != held){
+        lock_acquire(as->pt_lock);
+    }
+    if(ret){
+        // put it back, nothing was lost
+        insert_pt(page, pte, as);
+        frame_set_owner(frame, as, page);
+        swap_free(slot);
+    }
+    else{
+        insert_pt(page, MKPTE_SWAP(slot), as);
+        free_kpages(PADDR_TO_KVADDR(frame));
+        vm_evictions++;
+    }
+    vm_transit_done(as);
+    if(as != held){
+        lock_release(as->pt_lock);
+    }
+    return ret;
+}
+
+// Take a page off the zero pool, or 0 if it is empty. COUNT says
+// whether this is a first-touch fault that should show in the stats.
+static vaddr_t zero_pool_take(bool count)
+{
+    vaddr_t vBase = 0;
+    lock_acquire(zero_lock);
+    if(zero_count > 0){
+        vBase = zero_pool[--zero_count];
+    }
+    if(count && vBase != 0){
+        zero_hits++;
+    }
+    else if(count){
+        zero_misses++;
+    }
+    if(zero_count < ZERO_POOL_LOW){
+        cv_signal(zero_cv, zero_lock);
+    }
+    lock_release(zero_lock);
+    return vBase;
+}
+
+// Whether there's enough free memory to keep zeroed pages around
+static bool zero_pool_room(void)
+{
+    unsigned nframes, nfree;
+    frame_counts(&nframes, &nfree);
+    return nfree > nframes / ZERO_POOL_RESERVE;
+}
+
+// Sleep until the CPU we're on runs out of other threads
+static void zero_wait_idle(void)
+{
+    spinlock_acquire(&zero_idle_lock);
+    zero_idle_cpu = curcpu->c_self;
+    wchan_sleep(zero_idle_wchan, &zero_idle_lock);
+    spinlock_release(&zero_idle_lock);
+}
+
+// Called from the idle loop. Wakes the pagezero thread if it is
+// waiting for this CPU to go idle, and returns whether it did, in
+// which case there is something to run after all.
+bool vm_idle(void)
+{
+    // an unlocked peek, as this runs every time the CPU idles
+    if(zero_idle_cpu != curcpu->c_self){
+        return false;
+    }
+    spinlock_acquire(&zero_idle_lock);
+    bool woke = zero_idle_cpu == curcpu->c_self;
+    if(woke){
+        zero_idle_cpu = NULL;
+        wchan_wakeone(zero_idle_wchan, &zero_idle_lock);
+    }
+    spinlock_release(&zero_idle_lock);
+    return woke;
+}
+
+// Body of the pagezero thread. Zeroes one page at a time, and before
+// each one sleeps until its CPU has nothing else to run, so it only
+// uses time that would otherwise go to the idle loop.
+static void vm_zerothread(void *data1, unsigned long data2)
+{
+    (void)data1;
+    (void)data2;
+
+    while(1){
+        lock_acquire(zero_lock);
+        while(zero_count >= ZERO_POOL_LOW || !zero_pool_room()){
+            cv_wait(zero_cv, zero_lock);
+        }
+        // fill all the way up once woken
+        while(zero_count < ZERO_POOL_SIZE && zero_pool_room()){
+            lock_release(zero_lock);
+            if(!thread_cpu_idle()){
+                zero_wait_idle();
+            }
+            vaddr_t vBase = alloc_kpages(1);
+            if(vBase == 0){
+                lock_acquire(zero_lock);
+                break;
+            }
+            bzero((void *) vBase, PAGE_SIZE);
+            lock_acquire(zero_lock);
+            zero_pool[zero_count++] = vBase;
+        }
+        lock_release(zero_lock);
+    }
+}
+
+/*
+ * Kernel reserve. Kernel allocations never evict, so user pages leave
+ * 1/KERNEL_RESERVE of memory free for page tables, kmalloc and new
+ * threads, and start evicting once free memory drops below it.
+ */
+#define KERNEL_RESERVE 16
+
+static bool vm_below_reserve(void)
+{
+    unsigned nframes, nfree;
+    frame_counts(&nframes, &nfree);
+    return nfree < nframes / KERNEL_RESERVE;
+}
+
+// Get a frame for a user page, evicting another page if RAM is full or
+// the kernel reserve is running low. AS is the address space whose page
+// table lock the caller holds, if any; eviction drops the locks while it
+// writes, so entries the caller looked up before may have changed.
+static vaddr_t vm_alloc_page(struct addrspace *as)
+{
+    // with nothing left to evict, the reserve is better used than failing
+    while(vm_below_reserve()){
+        if(vm_evict(as)){
+            break;
+        }
+    }
+    vaddr_t vBase = alloc_kpages(1);
+    while(vBase == 0){
+        // zeroed pages are still free memory, use them before swapping
+        vBase = zero_pool_take(false);
+        if(vBase != 0){
+            break;
+        }
+        if(vm_evict(as)){
+            return 0;
+        }
+        vBase = alloc_kpages(1);
+    }
+    return vBase;
+}
+
+vaddr_t vm_getpage(void)
+{
+    vm_paging_lock(NULL);
+    vaddr_t vBase = vm_alloc_page(NULL);
+    vm_paging_unlock(NULL);
+    return vBase;
+}
+
+// Get a zero filled frame for a first-touch fault in AS, from the pool
+// if the pagezero thread has one ready. May drop the locks, like
+// vm_alloc_page.
+static vaddr_t vm_alloc_zeroed_page(struct addrspace *as)
+{
+    vaddr_t vBase = zero_pool_take(true);
+    if(vBase != 0){
+        return vBase;
+    }
+    vBase = vm_alloc_page(as);
+    if(vBase != 0){
+        bzero((void *) vBase, PAGE_SIZE);
+    }
+    return vBase;
+}
+
+// Page table flags for a page of AS that it has to itself. Pages of
+// writable regions get PTE_WRITE, and if WRITTEN says the page is
+// being written right away they are entered dirty to save a fault.
+static paddr_t vm_pte_flags(vaddr_t page, struct addrspace *as, bool written)
+{
+    struct region *region = lookup_region(page, as);
+    if(region == NULL || !(region->permission & WRITE)){
+        return TLBLO_VALID;
+    }
+    if(written){
+        return TLBLO_DIRTY | TLBLO_VALID | PTE_WRITE | PTE_DIRTY;
+    }
+    return TLBLO_VALID | PTE_WRITE;
+}
+
+// First write to PAGE of AS, whose entry PTE has PTE_WRITE: let the TLB
+// write it and remember that it was
+static void vm_set_dirty(vaddr_t page, paddr_t pte, struct addrspace *as,
+                         paddr_t *ret)
+{
+    KASSERT(pte & PTE_WRITE);
+    *ret = pte | TLBLO_DIRTY | PTE_DIRTY;
+    // the entry exists, this can't fail
+    insert_pt(page, *ret, as);
+    vm_dirtied++;
+}
+
+// Function to read a swapped out page back into a fresh frame. The
+// locks are dropped while it reads, and while it waits for the page to
+// finish going out if it is still on its way.
+int vm_pagein(vaddr_t page, struct addrspace *as, paddr_t *ret)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT(lock_do_i_hold(as->pt_lock));
+    paddr_t pte;
+    vaddr_t vBase;
+    while(1){
+        pte = lookup_pt(page, as);
+        // its write to swap failed, so it never left
+        if(pte & TLBLO_VALID){
+            *ret = pte;
+            return 0;
+        }
+        KASSERT(pte & PTE_SWAPPED);
+        if(pte & PTE_TRANSIT){
+            vm_transit_sleep(as);
+            continue;
+        }
+        vBase = vm_alloc_page(as);
+        if(vBase == 0){
+            return ENOMEM;
+        }
+        if(lookup_pt(page, as) == pte){
+            break;
+        }
+        free_kpages(vBase);
+    }
+    unsigned slot = PTE_SWAPSLOT(pte);
+
+    insert_pt(page, pte | PTE_TRANSIT, as);
+    as->transit++;
+    vm_paging_unlock(as);
+    int err = swap_in(slot, vBase);
+    vm_paging_lock(as);
+    vm_transit_done(as);
+    if(err){
+        insert_pt(page, pte, as);
+        free_kpages(vBase);
+        return err;
+    }
+    // clean as far as the TLB goes, but swap no longer has a copy
+    *ret = KVADDR_TO_PADDR(vBase) | vm_pte_flags(page, as, false) | PTE_DIRTY;
+    // the entry exists already, this can't fail
+    insert_pt(page, *ret, as);
+    frame_set_owner(KVADDR_TO_PADDR(vBase), as, page);
+    swap_free(slot);
+    vm_pageins++;
+    return 0;
+}
+
+// First touch of a page of a mapped file: enter the page cache's frame,
+// which every other mapping of the same page shares. The locks are
+// dropped while the page is read in; nothing else adds entries to AS.
+static int vm_fault_file(vaddr_t page, struct region *region,
+                         struct addrspace *as, bool write, paddr_t *ret)
+{
+    struct vnode *vn = region->vnode;
+    off_t offset = REGION_FILEOFF(region, page);
+    paddr_t frame;
+
+    vm_paging_unlock(as);
+    int err = pagecache_get(vn, offset, &frame);
+    vm_paging_lock(as);
+    if(err){
+        return err;
+    }
+    // no owner, so the frame is never picked for eviction
+    *ret = frame | vm_pte_flags(page, as, write);
+    err = insert_pt(page, *ret, as);
+    if(err){
+        pagecache_put(vn, offset, false);
+        return err;
+    }
+    return 0;
+}
+
+// Whether any of PAGE comes from the file in a PRIVATE region
+static bool region_file_page(vaddr_t page, struct region *region)
+{
+    return (region->permission & PRIVATE) &&
+           page < region->fileend && page + PAGE_SIZE > region->filestart;
+}
+
+// Fill the frame at VBASE for PAGE of a PRIVATE region of AS: its part
+// of the file, zeros around it. The locks are dropped for the read; the
+// frame has no owner yet, so it can't be evicted meanwhile.
+static int vm_read_page(vaddr_t page, struct region *region,
+                        struct addrspace *as, vaddr_t vBase)
+{
+    vaddr_t start = page > region->filestart ? page : region->filestart;
+    vaddr_t end = page + PAGE_SIZE < region->fileend ?
+                  page + PAGE_SIZE : region->fileend;
+    struct iovec iov;
+    struct uio ku;
+
+    bzero((void *) vBase, start - page);
+    bzero((void *)(vBase + (end - page)), page + PAGE_SIZE - end);
+    uio_kinit(&iov, &ku, (void *)(vBase + (start - page)), end - start,
+              REGION_FILEOFF(region, start), UIO_READ);
+    vm_paging_unlock(as);
+    int err = VOP_READ(region->vnode, &ku);
+    vm_paging_lock(as);
+    if(err){
+        return err;
+    }
+    if(ku.uio_resid != 0){
+        // the file got shorter than it was at exec
+        return EIO;
+    }
+    vm_fileloads++;
+    return 0;
+}
+
+// A fault below the stack grows it down to the faulting page, as long
+// as it stays within the stack limit and leaves an unmapped guard page
+// above the region below. Returns whether it did.
+static bool vm_grow_stack(vaddr_t page, struct addrspace *as)
+{
+    struct region *stack = as->stack;
+    if(stack == NULL || page >= stack->base ||
+       page < USERSTACK - as->stack_limit){
+        return false;
+    }
+    unsigned r = 0;
+    while(as->regions[r] != stack){
+        r++;
+    }
+    if(r > 0){
+        struct region *below = as->regions[r - 1];
+        if(below->base + below->size + PAGE_SIZE > page){
+            return false;
+        }
+    }
+    stack->size += stack->base - page;
+    stack->base = page;
+    vm_stackgrows++;
+    return true;
+}
+
+// Find or make the page table entry for a faulting page. Fails with
+// EAGAIN if the entry changed while the locks were dropped.
+static int vm_fault_page(int faulttype, vaddr_t faultaddress,
+                         struct addrspace *as, paddr_t *ret, bool *fresh)
 {
-    // Check read_only
+    // Look up the page table
+    paddr_t f_addr = lookup_pt(faultaddress, as);
+    *fresh = f_addr == 0;
+    // Paged out, bring it back first
+    if(f_addr & PTE_SWAPPED){
+        int err = vm_pagein(faultaddress, as, &f_addr);
+        if(err){
+            return err;
+        }
+    }
+    bool write = faulttype != VM_FAULT_READ;
+    // Write to a page entered without TLBLO_DIRTY: the first write to a
+    // clean page, or one to a frame shared copy-on-write
     if(faulttype == VM_FAULT_READONLY){
-        return EFAULT;
+        if(f_addr & PTE_WRITE){
+            vm_set_dirty(faultaddress, f_addr, as, ret);
+            return 0;
+        }
+        return copy_on_write(faultaddress, f_addr, as, ret);
+    }
+    // Write that missed the TLB, don't make it fault again to get dirty
+    if(write && (f_addr & PTE_WRITE) && !(f_addr & TLBLO_DIRTY)){
+        vm_set_dirty(faultaddress, f_addr, as, ret);
+        return 0;
     }
+    // Zero meaning NULL first level
+    if(f_addr == 0){
+        // check if the region is valid
+        int err = check_valid_region(faultaddress, as);
+        if(err && !vm_grow_stack(faultaddress, as)){
+            return err;
+        }
+        struct region *region = lookup_region(faultaddress, as);
+        if(REGION_CACHED(region)){
+            return vm_fault_file(faultaddress, region, as, write, ret);
+        }
+        vaddr_t vBase;
+        paddr_t flags = vm_pte_flags(faultaddress, as, write);
+        if(region_file_page(faultaddress, region)){
+            flags |= PTE_FILE;
+            vBase = vm_alloc_page(as);
+            if(vBase != 0){
+                err = vm_read_page(faultaddress, region, as, vBase);
+                if(err){
+                    free_kpages(vBase);
+                    return err;
+                }
+            }
+        }
+        else if(faulttype == VM_FAULT_READ){
+            // Nothing to read but zeros, share the zero frame until
+            // the first write
+            f_addr = vm_zeroframe | TLBLO_VALID;
+            err = insert_pt(faultaddress, f_addr, as);
+            if(err){
+                return err;
+            }
+            VM_CPUSTAT_INC(vc_zeromaps);
+            *ret = f_addr;
+            return 0;
+        }
+        else{
+            vBase = vm_alloc_zeroed_page(as);
+        }
+        // alloc_kpages failed
+        if(vBase == 0){
+            return ENOMEM;
+        }
+        // convert the vBAse then insert into the pagetable
+        f_addr = KVADDR_TO_PADDR(vBase) | flags;
+        err = insert_pt(faultaddress, f_addr, as);
+        if(err){
+            free_kpages(vBase);
+            return err;
+        }
+        frame_set_owner(KVADDR_TO_PADDR(vBase), as, faultaddress);
+    }
+    *ret = f_addr;
+    return 0;
+}
+
+// Bring in the pages of REGION from START up to END that would need
+// I/O to fault in: swapped out pages and file pages not read yet.
+// Untouched anonymous pages are left alone. May drop the locks.
+static int vm_prefault(struct addrspace *as, struct region *region,
+                       vaddr_t start, vaddr_t end)
+{
+    for(vaddr_t page = start; page < end; page += PAGE_SIZE){
+        paddr_t pte = lookup_pt(page, as);
+        if(pte & TLBLO_VALID){
+            continue;
+        }
+        if(pte == 0 && !REGION_CACHED(region) &&
+           !region_file_page(page, region)){
+            continue;
+        }
+        bool fresh;
+        int err = vm_fault_page(VM_FAULT_READ, page, as, &pte, &fresh);
+        if(err){
+            return err;
+        }
+        vm_prefaulted++;
+    }
+    return 0;
+}
+
+// A zero filled frame from the pool, or from free memory above the
+// kernel reserve; 0 if getting one would mean paging something out.
+// COUNT as for zero_pool_take.
+static vaddr_t vm_try_zeroed_page(bool count)
+{
+    vaddr_t vBase = zero_pool_take(count);
+    if(vBase != 0){
+        return vBase;
+    }
+    if(vm_below_reserve()){
+        return 0;
+    }
+    vBase = alloc_kpages(1);
+    if(vBase != 0){
+        bzero((void *) vBase, PAGE_SIZE);
+    }
+    return vBase;
+}
+
+// Zero fill page PAGE of AS, with the zero frame unless WRITE says it
+// is being written. FAULT says it is the faulting page rather than one
+// ahead of it. Only uses free memory above the kernel reserve, never
+// pages anything out, so only needs AS's page table lock. Returns the
+// new entry or 0.
+static paddr_t vm_zero_ahead(vaddr_t page, struct addrspace *as, bool write,
+                             bool fault)
+{
+    if(!write){
+        paddr_t pte = vm_zeroframe | TLBLO_VALID;
+        if(insert_pt(page, pte, as)){
+            return 0;
+        }
+        VM_CPUSTAT_INC(vc_zeromaps);
+        return pte;
+    }
+    vaddr_t vBase = vm_try_zeroed_page(fault);
+    if(vBase == 0){
+        return 0;
+    }
+    // it is being written, or will be soon if the scan is writing
+    paddr_t pte = KVADDR_TO_PADDR(vBase) | vm_pte_flags(page, as, true);
+    if(insert_pt(page, pte, as)){
+        free_kpages(vBase);
+        return 0;
+    }
+    frame_set_owner(KVADDR_TO_PADDR(vBase), as, page);
+    return pte;
+}
+
+// Load the TLB with the resident neighbours of the page that just
+// faulted, and zero fill the rest of the window if FRESH says this
+// was a first touch continuing a sequential scan; WRITE says whether
+// it was a write. madvise can turn this off for a region
+// (MADV_RANDOM), or widen it and read file pages ahead (MADV_SEQUENTIAL).
+// It only needs AS's page table lock unless FRESH in a region with a
+// file, where reading ahead may page.
+static void vm_fault_around(vaddr_t faultaddress, struct addrspace *as,
+                            bool fresh, bool write)
+{
+    struct region *region = lookup_region(faultaddress, as);
+    if(region == NULL || region->advice == MADV_RANDOM){
+        return;
+    }
+    bool sequential = region->advice == MADV_SEQUENTIAL;
+    unsigned window = sequential ? FAULTAROUND_MAX : vm_faultaround;
+    if(window <= 1){
+        return;
+    }
+    vaddr_t start = faultaddress & ~(vaddr_t)(window * PAGE_SIZE - 1);
+    vaddr_t end = start + window * PAGE_SIZE;
+    if(start < region->base){
+        start = region->base;
+    }
+    if(end > region->base + region->size || end < start){
+        end = region->base + region->size;
+    }
+    if(fresh && sequential && region->vnode != NULL){
+        // read ahead, a failure just leaves those pages to fault
+        vm_prefault(as, region, faultaddress + PAGE_SIZE, end);
+    }
+    // file pages are never zero filled
+    bool ahead = fresh && region->vnode == NULL &&
+                 (sequential || faultaddress == as->last_fault + PAGE_SIZE);
+
+    for(vaddr_t page = start; page < end; page += PAGE_SIZE){
+        if(page == faultaddress){
+            continue;
+        }
+        paddr_t pte = lookup_pt(page, as);
+        if(pte == 0 && ahead && page > faultaddress){
+            pte = vm_zero_ahead(page, as, write, false);
+            if(pte != 0){
+                region->zeroahead++;
+                VM_CPUSTAT_INC(vc_zeroahead);
+                // so the scan is still sequential when it gets past here
+                as->last_fault = page;
+            }
+        }
+        if(!(pte & TLBLO_VALID)){
+            continue;
+        }
+        int spl = splhigh();
+        uint32_t hi = (page & TLBHI_VPAGE) |
+                      (curcpu->c_tlbpid << TLBHI_PIDSHIFT);
+        if(tlb_probe(hi, 0) < 0){
+            tlb_random(hi, PTE_TLBLO(pte));
+            region->prefilled++;
+            vm_cpustats[curcpu->c_number].vc_prefilled++;
+        }
+        splx(spl);
+    }
+}
+
+int vm_set_faultaround(unsigned npages)
+{
+    if(npages == 0 || npages > FAULTAROUND_MAX || (npages & (npages - 1))){
+        return EINVAL;
+    }
+    lock_acquire(vm_lock);
+    vm_faultaround = npages;
+    lock_release(vm_lock);
+    return 0;
+}
+
+// Load the TLB entry for PAGE from its page table entry PTE; REFILL
+// says the page was mapped already. Call with AS's page table lock held.
+static void vm_tlb_load(vaddr_t page, paddr_t pte, bool refill)
+{
+    // get hi and lo, the entry already carries the TLB flags
+    uint32_t lo = PTE_TLBLO(pte);
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+    int spl = splhigh();
+    uint32_t hi = (page & TLBHI_VPAGE) |
+                  (curcpu->c_tlbpid << TLBHI_PIDSHIFT);
+    // Replace the stale entry after a readonly fault, never duplicate it
+    int index = tlb_probe(hi, 0);
+    if(index >= 0){
+        tlb_write(hi, lo, index);
+    }
+    else{
+        tlb_random(hi, lo);
+    }
+    struct vm_cpustats *vc = &vm_cpustats[curcpu->c_number];
+    vc->vc_faults++;
+    if(refill){
+        vc->vc_refills++;
+    }
+    splx(spl);
+}
+
+// The page is in use, give it a second chance under clock. A frame
+// that was shared copy-on-write and is down to this one mapping becomes
+// evictable again; mapped page cache frames always hold the cache's
+// reference as well, and the zero frame is never anyone's.
+static void vm_fault_reference(vaddr_t page, paddr_t *pte,
+                               struct addrspace *as)
+{
+    paddr_t frame = PTE_FRAME(*pte);
+    frame_reference(frame, frame == vm_zeroframe ? NULL : as, page);
+    if(!(*pte & PTE_REFERENCED)){
+        *pte |= PTE_REFERENCED;
+        insert_pt(page, *pte, as);
+    }
+}
+
+// First touch of an anonymous page at PAGE of AS, whose entry is PTE,
+// or the first write to one mapped to the zero frame, when it needs no
+// paging. Only needs AS's page table lock, so first-touch faults on
+// different CPUs don't all wait on vm_lock. Returns the new entry, or 0
+// to leave the fault to vm_fault_page.
+static paddr_t vm_fault_anon(int faulttype, vaddr_t page, paddr_t pte,
+                             struct addrspace *as)
+{
+    struct region *region = lookup_region(page, as);
+    if(region == NULL || region->vnode != NULL){
+        return 0;
+    }
+    if(pte == 0 && faulttype != VM_FAULT_READONLY){
+        return vm_zero_ahead(page, as, faulttype != VM_FAULT_READ, true);
+    }
+    // as copy_on_write does it
+    if(faulttype != VM_FAULT_READONLY || !(pte & TLBLO_VALID) ||
+       PTE_FRAME(pte) != vm_zeroframe || !(region->permission & WRITE)){
+        return 0;
+    }
+    vaddr_t vBase = vm_try_zeroed_page(true);
+    if(vBase == 0){
+        return 0;
+    }
+    paddr_t ret = KVADDR_TO_PADDR(vBase) | vm_pte_flags(page, as, true);
+    if(insert_pt(page, ret, as)){
+        free_kpages(vBase);
+        return 0;
+    }
+    frame_set_owner(KVADDR_TO_PADDR(vBase), as, page);
+    vm_tlb_invalidate(page, as);
+    VM_CPUSTAT_INC(vc_zerocopies);
+    return ret;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
     // Check invalid address
     if(faultaddress == 0x0){
         return EFAULT;
     }
+    // kernel memory from vmalloc, needs no process or sleeping
+    if(faultaddress >= MIPS_KSEG2){
+        return vmalloc_fault(faulttype, faultaddress);
+    }
     if(curproc == NULL){
 		/*
 		 * No process. This is probably a kernel fault early
@@ -44,7 +1286,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     }
 
 	struct addrspace *as = proc_getas();
-	if (as == NULL || as->region_head == NULL || as->pagetable == NULL) {
+	if (as == NULL || as->nregions == 0 || as->pagetable == NULL) {
 		/*
 		 * No address space set up. This is probably also a
 		 * kernel fault early in boot.
@@ -54,84 +1296,334 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
     //FROM dumbvm
     faultaddress &= PAGE_FRAME;
-    // Look up the page table
+    bool write = faulttype != VM_FAULT_READ;
+
+    // Mapped already and the TLB just didn't have it: all it needs is
+    // the page table lock, so faults elsewhere don't wait on paging
+    lock_acquire(as->pt_lock);
     paddr_t f_addr = lookup_pt(faultaddress, as);
-    // Zero meaning NULL first level
-    if(f_addr == 0){
-        // check if the region is valid
-        int ret = check_valid_region(faultaddress, as);
-        if(ret){
-            return ret;
-        }
-        vaddr_t vBase = alloc_kpages(1);
-        // alloc_kpages failed
-        if(vBase == 0){
+    if((f_addr & TLBLO_VALID) && faulttype != VM_FAULT_READONLY &&
+       !(write && (f_addr & PTE_WRITE) && !(f_addr & TLBLO_DIRTY))){
+        vm_fault_reference(faultaddress, &f_addr, as);
+        vm_tlb_load(faultaddress, f_addr, true);
+        as->last_fault = faultaddress;
+        vm_fault_around(faultaddress, as, false, write);
+        lock_release(as->pt_lock);
+        return 0;
+    }
+    // First touch of an anonymous page, as long as nothing need be
+    // paged out for it
+    paddr_t pte = vm_fault_anon(faulttype, faultaddress, f_addr, as);
+    if(pte != 0){
+        vm_fault_reference(faultaddress, &pte, as);
+        vm_tlb_load(faultaddress, pte, false);
+        as->last_fault = faultaddress;
+        vm_fault_around(faultaddress, as, f_addr == 0, write);
+        lock_release(as->pt_lock);
+        return 0;
+    }
+    lock_release(as->pt_lock);
+
+    bool fresh;
+    vm_paging_lock(as);
+    int ret = vm_fault_page(faulttype, faultaddress, as, &f_addr, &fresh);
+    if(ret){
+        vm_paging_unlock(as);
+        // changed under us while paging, let it fault again
+        return ret == EAGAIN ? 0 : ret;
+    }
+    vm_fault_reference(faultaddress, &f_addr, as);
+    vm_tlb_load(faultaddress, f_addr, false);
+    as->last_fault = faultaddress;
+    vm_fault_around(faultaddress, as, fresh, write);
+    vm_paging_unlock(as);
+    return 0;
+}
+
+// Check that every page from START up to END is in a region of AS
+static int vm_range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    vaddr_t addr = start;
+    while(addr < end){
+        struct region *region = lookup_region(addr, as);
+        if(region == NULL){
             return ENOMEM;
         }
-        // convert the vBAse and zero the mems then insert into the pagetable
-        f_addr = KVADDR_TO_PADDR(vBase);
-        bzero((void *) vBase, PAGE_SIZE);
-        ret = insert_pt(faultaddress, f_addr, as);
-        if(ret){
-            return ret;
+        addr = region->base + region->size;
+    }
+    return 0;
+}
+
+int vm_madvise(struct addrspace *as, vaddr_t start, vaddr_t end, int advice)
+{
+    if(advice < MADV_NORMAL || advice > MADV_DONTNEED){
+        return EINVAL;
+    }
+    vm_paging_lock(as);
+    int err = vm_range_mapped(as, start, end);
+    vaddr_t next;
+    for(vaddr_t addr = start; err == 0 && addr < end; addr = next){
+        struct region *region = lookup_region(addr, as);
+        next = region->base + region->size;
+        if(next > end){
+            next = end;
+        }
+        switch(advice){
+          case MADV_NORMAL:
+          case MADV_RANDOM:
+          case MADV_SEQUENTIAL:
+            region->advice = advice;
+            break;
+          case MADV_WILLNEED:
+            err = vm_prefault(as, region, addr, next);
+            break;
+          case MADV_DONTNEED:
+            // anonymous pages read as zeros again, file pages are
+            // read from the file
+            vm_unmap(as, region, addr, next);
+            break;
         }
     }
-    // get hi and lo
-    uint32_t hi = faultaddress & TLBHI_VPAGE;
-    uint32_t lo = f_addr | TLBLO_DIRTY | TLBLO_VALID;
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+    vm_paging_unlock(as);
+    if(advice == MADV_DONTNEED){
+        pagecache_reap();
+    }
+    return err;
+}
+
+int vm_mincore(struct addrspace *as, vaddr_t start, vaddr_t end,
+               userptr_t vec)
+{
+    // a chunk at a time, copyout can't be done with the lock held; only
+    // reading, so the page table lock is enough
+    char buf[64];
+    lock_acquire(as->pt_lock);
+    int err = vm_range_mapped(as, start, end);
+    lock_release(as->pt_lock);
+    vaddr_t page = start;
+    while(err == 0 && page < end){
+        unsigned n = 0;
+        lock_acquire(as->pt_lock);
+        while(n < sizeof(buf) && page < end){
+            paddr_t pte = lookup_pt(page, as);
+            char bits = 0;
+            if(pte & TLBLO_VALID){
+                bits |= MINCORE_INCORE;
+            }
+            if(pte & PTE_REFERENCED){
+                bits |= MINCORE_REFERENCED;
+            }
+            if(pte & PTE_DIRTY){
+                bits |= MINCORE_MODIFIED;
+            }
+            buf[n++] = bits;
+            page += PAGE_SIZE;
+        }
+        lock_release(as->pt_lock);
+        err = copyout(buf, vec, n);
+        vec += n;
+    }
+    return err;
+}
+
+/*
+ * Reference sweep. Each call throws away the next TLBSWEEP_SLOTS slots
+ * of this CPU's TLB, going round it in turn, so pages that are still
+ * in use fault again and get their reference bit set while most of the
+ * TLB, other address spaces' entries included, stays loaded. vmalloc's
+ * global entries are left alone, they aren't user pages.
+ */
+#define TLBSWEEP_SLOTS (NUM_TLB / 8)
+static unsigned tlb_sweephand[MAXCPUS];  // each CPU's own next slot
+
+// Called from hardclock
+void vm_tlbsweep(void)
+{
     int spl = splhigh();
-    tlb_random(hi, lo);
+    unsigned *hand = &tlb_sweephand[curcpu->c_number];
+    for(unsigned n = 0; n < TLBSWEEP_SLOTS; n++){
+        unsigned i = *hand;
+        *hand = (i + 1) % NUM_TLB;
+        uint32_t hi, lo;
+        tlb_read(&hi, &lo, i);
+        if((lo & TLBLO_VALID) && !(lo & TLBLO_GLOBAL)){
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+    tlb_setpid(curcpu->c_tlbpid);
+    // only once they are gone, see tlb_shootdown_cpus
+    spinlock_acquire(&asid_spinlock);
+    curcpu->c_tlbswept += TLBSWEEP_SLOTS;
+    spinlock_release(&asid_spinlock);
     splx(spl);
-    return 0;
+}
+
+void vm_printstats(void)
+{
+    lock_acquire(vm_lock);
+    kprintf("Paging: %u evictions (%u clean, dropped), %u pageins, "
+            "%u loaded from files\n",
+            vm_evictions, vm_discards, vm_pageins, vm_fileloads);
+    kprintf("Dirty: %u first writes to clean pages\n", vm_dirtied);
+    kprintf("Stack: %u faults grew a stack\n", vm_stackgrows);
+    unsigned faults = 0, refills = 0, prefilled = 0;
+    unsigned zeroahead = 0, zeromaps = 0, zerocopies = 0;
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        faults += vm_cpustats[i].vc_faults;
+        refills += vm_cpustats[i].vc_refills;
+        prefilled += vm_cpustats[i].vc_prefilled;
+        zeroahead += vm_cpustats[i].vc_zeroahead;
+        zeromaps += vm_cpustats[i].vc_zeromaps;
+        zerocopies += vm_cpustats[i].vc_zerocopies;
+    }
+    kprintf("TLB faults: %u, %u of them refills of mapped pages\n",
+            faults, refills);
+    kprintf("Fault-around (%u pages): %u pages prefilled, %u zeroed ahead, "
+            "%u read ahead\n",
+            vm_faultaround, prefilled, zeroahead, vm_prefaulted);
+    kprintf("Zero frame: %u pages mapped to it, %u written to later\n",
+            zeromaps, zerocopies);
+    lock_release(vm_lock);
+    spinlock_acquire(&asid_spinlock);
+    unsigned flushes = tlb_flushes;
+    unsigned rollovers = tlb_rollovers;
+    unsigned shootdowns = tlb_shootdowns;
+    unsigned shootipis = tlb_shootipis;
+    unsigned shootskips = tlb_shootskips;
+    spinlock_release(&asid_spinlock);
+    kprintf("TLB: %u ASID flushes, %u ASID rollovers\n", flushes, rollovers);
+    kprintf("TLB shootdowns: %u batches, %u IPIs, %u CPUs skipped\n",
+            shootdowns, shootipis, shootskips);
+    for(unsigned i = 0; i < cpu_count(); i++){
+        struct cpu *c = cpu_get(i);
+        kprintf("  cpu%u: %u activations kept the TLB as it was\n",
+                i, c->c_tlbkept);
+    }
+    lock_acquire(zero_lock);
+    kprintf("Zero pool: %u pages, %u hits, %u misses\n",
+            zero_count, zero_hits, zero_misses);
+    lock_release(zero_lock);
+    frame_printstats();
+    vmalloc_printstats();
+    pt_printstats();
+    pagecache_printstats();
 }
 
 /*
- * SMP-specific functions.  Unused in our UNSW configuration.
+ * SMP-specific functions.
  */
 
+// Called from interprocessor_interrupt for each shootdown queued here
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    int spl = splhigh();
+    tlb_drop(ts);
+    splx(spl);
+    spinlock_acquire(&ts->ts_wait->tw_lock);
+    ts->ts_wait->tw_pending--;
+    spinlock_release(&ts->ts_wait->tw_lock);
 }
 
-// Function to check if the region is valid
-int check_valid_region(vaddr_t page, struct addrspace *as){
-    struct region *curNode =  as->region_head;
-    while(curNode != NULL){
-        vaddr_t base = curNode->base;
-        vaddr_t top = curNode->base + (curNode->size * PAGE_SIZE);
-        if(page >= base && page < top){
-            return 0;
+// Function to find the region containing the address. Faults tend to
+// hit the same region over and over, so try the last one found first,
+// then binary search the sorted array.
+struct region *lookup_region(vaddr_t addr, struct addrspace *as){
+    struct region *curNode = as->last_region;
+    if(curNode != NULL && addr >= curNode->base &&
+       addr < curNode->base + curNode->size){
+        return curNode;
+    }
+    unsigned lo = 0;
+    unsigned hi = as->nregions;
+    while(lo < hi){
+        unsigned mid = lo + (hi - lo) / 2;
+        curNode = as->regions[mid];
+        if(addr < curNode->base){
+            hi = mid;
+        }
+        else if(addr >= curNode->base + curNode->size){
+            lo = mid + 1;
+        }
+        else{
+            as->last_region = curNode;
+            return curNode;
         }
-        curNode = curNode->next;
     }
-    return EFAULT;
+    return NULL;
 }
-// Function to lookup the pagetable
-paddr_t lookup_pt(uint32_t page, struct addrspace *as){
-    uint32_t firstIndex = page >> 21;
-    if(as->pagetable[firstIndex] == NULL){
-        return 0;
+// Function to check if the region is valid
+int check_valid_region(vaddr_t page, struct addrspace *as){
+    if(lookup_region(page, as) == NULL){
+        return EFAULT;
     }
-    uint32_t secondIndex = (page << 11) >> 23;
-    return as->pagetable[firstIndex][secondIndex];
+    return 0;
 }
-// function to insert the pagetable
-int insert_pt(vaddr_t page, paddr_t frame, struct addrspace *as) {
-    uint32_t firstIndex = page >> 21;
-    if (as->pagetable[firstIndex] == NULL){
-        as->pagetable[firstIndex] = kmalloc(PT_SECOND_SIZE * sizeof(paddr_t *));
-        if(as->pagetable[firstIndex] == NULL){
+// Function to give the faulting address space a writable copy of a
+// frame it shares with other address spaces after as_copy
+int copy_on_write(vaddr_t page, paddr_t pte, struct addrspace *as, paddr_t *ret){
+    if(pte == 0){
+        return EFAULT;
+    }
+    // Only writable regions get their shared frames broken
+    struct region *region = lookup_region(page, as);
+    if(region == NULL || !(region->permission & WRITE)){
+        return EFAULT;
+    }
+    // Mapped files are shared, the write goes to the page cache's frame
+    if(REGION_CACHED(region)){
+        *ret = pte | vm_pte_flags(page, as, true);
+        return insert_pt(page, *ret, as);
+    }
+    paddr_t frame = PTE_FRAME(pte);
+    // First write to a page that was only read so far
+    if(frame == vm_zeroframe){
+        vaddr_t vBase = vm_alloc_zeroed_page(as);
+        if(vBase == 0){
             return ENOMEM;
         }
-        for (int i = 0; i < PT_SECOND_SIZE; i++){
-            as->pagetable[firstIndex][i] = 0;
+        if(lookup_pt(page, as) != pte){
+            free_kpages(vBase);
+            return EAGAIN;
+        }
+        *ret = KVADDR_TO_PADDR(vBase) | vm_pte_flags(page, as, true);
+        int err = insert_pt(page, *ret, as);
+        if(err){
+            free_kpages(vBase);
+            return err;
         }
+        frame_set_owner(KVADDR_TO_PADDR(vBase), as, page);
+        // other CPUs this ran on may still read zeroes through the
+        // old entry
+        vm_tlb_invalidate(page, as);
+        VM_CPUSTAT_INC(vc_zerocopies);
+        return 0;
+    }
+    // Last user of the frame, just take it back as writable
+    if(frame_refcount(frame) == 1){
+        *ret = pte | vm_pte_flags(page, as, true);
+        frame_set_owner(frame, as, page);
+        return insert_pt(page, *ret, as);
+    }
+    vaddr_t vBase = vm_alloc_page(as);
+    if(vBase == 0){
+        return ENOMEM;
     }
-    uint32_t secondIndex = (page << 11) >> 23;
-    as->pagetable[firstIndex][secondIndex] = frame;
+    // the locks may have been dropped to page something out
+    if(lookup_pt(page, as) != pte){
+        free_kpages(vBase);
+        return EAGAIN;
+    }
+    memcpy((void *) vBase, (const void *) PADDR_TO_KVADDR(frame), PAGE_SIZE);
+    *ret = KVADDR_TO_PADDR(vBase) | vm_pte_flags(page, as, true);
+    int err = insert_pt(page, *ret, as);
+    if(err){
+        free_kpages(vBase);
+        return err;
+    }
+    frame_set_owner(KVADDR_TO_PADDR(vBase), as, page);
+    vm_tlb_invalidate(page, as);
+    // drop our reference to the shared frame
+    free_kpages(PADDR_TO_KVADDR(frame));
     return 0;
-}
\ No newline at end of file
+}
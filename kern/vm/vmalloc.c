@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <vm.h>
+
+/*
+ * vmalloc: large kernel allocations that don't need contiguous
+ * physical memory.
+ *
+ * An area is a run of single frames from alloc_kpages mapped at
+ * consecutive pages of kseg2, followed by an unmapped guard page that
+ * catches overruns. The mappings live in a kernel page table with one
+ * entry per kseg2 page, holding the EntryLo to load for it; kseg2
+ * misses come here from vm_fault and are refilled as global entries.
+ *
+ * vfree only drops the area's entries from this CPU's TLB. Its pages
+ * (and guard) become stale and are not reused until a purge has
+ * dropped every kseg2 entry from the other CPUs that have loaded any,
+ * which vmalloc does only when it runs out of free pages. That costs
+ * one round of IPIs per purge instead of one per vfree.
+ */
+
+#define VMALLOC_BASE	MIPS_KSEG2
+#define VMALLOC_PAGES	4096		/* 16M of kseg2 */
+#define VMALLOC_END	(VMALLOC_BASE + VMALLOC_PAGES * PAGE_SIZE)
+
+/* page table entries that aren't mappings; none has TLBLO_VALID */
+#define VMALLOC_FREE	0
+#define VMALLOC_STALE	1		/* freed, may be in a remote TLB */
+#define VMALLOC_PURGING	2		/* stale, in the purge under way */
+#define VMALLOC_GUARD	3		/* ends an area */
+#define VMALLOC_RESERVED 4		/* frame not installed yet */
+
+#define VMALLOC_INDEX(va)	(((va) - VMALLOC_BASE) / PAGE_SIZE)
+#define VMALLOC_ADDR(i)		(VMALLOC_BASE + (i) * PAGE_SIZE)
+
+/* protects everything below */
+static struct spinlock vmalloc_spinlock = SPINLOCK_INITIALIZER;
+static uint32_t *vmalloc_pt;		/* the kernel page table */
+static unsigned vmalloc_hint;		/* where to start looking */
+static unsigned vmalloc_nstale;		/* stale entries */
+static uint32_t vmalloc_cpus;		/* CPUs that loaded any since a purge */
+
+static unsigned vmalloc_areas;		/* areas in use */
+static unsigned vmalloc_inuse;		/* pages in use */
+static unsigned vmalloc_allocs;
+static unsigned vmalloc_faults;
+static unsigned vmalloc_purges;
+static unsigned vmalloc_failures;
+
+/* one purge at a time */
+static struct lock *vmalloc_purgelock;
+
+void
+vmalloc_bootstrap(void)
+{
+	vmalloc_purgelock = lock_create("vmalloc purge");
+	if (vmalloc_purgelock == NULL) {
+		panic("vmalloc_bootstrap: Out of memory\n");
+	}
+	vmalloc_pt = kmalloc(VMALLOC_PAGES * sizeof(uint32_t));
+	if (vmalloc_pt == NULL) {
+		panic("vmalloc_bootstrap: Out of memory\n");
+	}
+	bzero(vmalloc_pt, VMALLOC_PAGES * sizeof(uint32_t));
+}
+
+/*
+ * Find NPAGES free entries in a row, next fit, and mark them
+ * reserved. Returns the first one's index or -1.
+ */
+static
+int
+vmalloc_reserve(unsigned npages)
+{
+	unsigned start, run, i, n;
+
+	KASSERT(spinlock_do_i_hold(&vmalloc_spinlock));
+
+	start = vmalloc_hint;
+	run = 0;
+	for (n = 0; n < VMALLOC_PAGES + npages; n++) {
+		i = (vmalloc_hint + n) % VMALLOC_PAGES;
+		if (i == 0) {
+			/* areas don't wrap */
+			start = 0;
+			run = 0;
+		}
+		if (vmalloc_pt[i] != VMALLOC_FREE) {
+			start = i + 1;
+			run = 0;
+			continue;
+		}
+		if (++run == npages) {
+			for (i = start; i < start + npages; i++) {
+				vmalloc_pt[i] = VMALLOC_RESERVED;
+			}
+			vmalloc_hint = (start + npages) % VMALLOC_PAGES;
+			return start;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Make the stale entries free again, after dropping them from every
+ * TLB that might hold them. Sleeps and sends IPIs.
+ */
+static
+void
+vmalloc_purge(void)
+{
+	uint32_t cpus;
+	unsigned i;
+
+	lock_acquire(vmalloc_purgelock);
+
+	spinlock_acquire(&vmalloc_spinlock);
+	for (i = 0; i < VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] == VMALLOC_STALE) {
+			vmalloc_pt[i] = VMALLOC_PURGING;
+		}
+	}
+	vmalloc_nstale = 0;
+	/* CPUs loading entries from now on will add themselves again */
+	cpus = vmalloc_cpus;
+	vmalloc_cpus = 0;
+	vmalloc_purges++;
+	spinlock_release(&vmalloc_spinlock);
+
+	vm_tlb_flush_kernel(cpus);
+
+	spinlock_acquire(&vmalloc_spinlock);
+	for (i = 0; i < VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] == VMALLOC_PURGING) {
+			vmalloc_pt[i] = VMALLOC_FREE;
+		}
+	}
+	spinlock_release(&vmalloc_spinlock);
+
+	lock_release(vmalloc_purgelock);
+}
+
+/*
+ * Whether we can sleep and wait on other CPUs here.
+ */
+static
+bool
+vmalloc_can_purge(void)
+{
+	return curthread != NULL && !curthread->t_in_interrupt &&
+		curthread->t_curspl == 0 && curcpu->c_spinlocks == 0;
+}
+
+void *
+vmalloc(size_t size)
+{
+	unsigned npages, i;
+	vaddr_t va;
+	int start;
+
+	if (vmalloc_pt == NULL || size == 0) {
+		return NULL;
+	}
+	npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages >= VMALLOC_PAGES) {
+		return NULL;
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+	start = vmalloc_reserve(npages + 1);
+	if (start < 0 && vmalloc_nstale > 0 && vmalloc_can_purge()) {
+		spinlock_release(&vmalloc_spinlock);
+		vmalloc_purge();
+		spinlock_acquire(&vmalloc_spinlock);
+		start = vmalloc_reserve(npages + 1);
+	}
+	if (start < 0) {
+		vmalloc_failures++;
+		spinlock_release(&vmalloc_spinlock);
+		return NULL;
+	}
+	vmalloc_pt[start + npages] = VMALLOC_GUARD;
+	spinlock_release(&vmalloc_spinlock);
+
+	/*
+	 * Nothing can be using the reserved pages yet, and nobody else
+	 * touches them, so fill them in without holding the spinlock
+	 * across alloc_kpages.
+	 */
+	for (i = 0; i < npages; i++) {
+		va = alloc_kpages(1);
+		if (va == 0) {
+			break;
+		}
+		spinlock_acquire(&vmalloc_spinlock);
+		vmalloc_pt[start + i] = KVADDR_TO_PADDR(va) | TLBLO_DIRTY |
+			TLBLO_VALID | TLBLO_GLOBAL;
+		spinlock_release(&vmalloc_spinlock);
+	}
+
+	if (i < npages) {
+		/* never mapped, so no TLB holds them and they're free now */
+		while (i-- > 0) {
+			free_kpages(PADDR_TO_KVADDR(vmalloc_pt[start + i] &
+						    TLBLO_PPAGE));
+		}
+		spinlock_acquire(&vmalloc_spinlock);
+		for (i = 0; i <= npages; i++) {
+			vmalloc_pt[start + i] = VMALLOC_FREE;
+		}
+		vmalloc_failures++;
+		spinlock_release(&vmalloc_spinlock);
+		return NULL;
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+	vmalloc_areas++;
+	vmalloc_inuse += npages;
+	vmalloc_allocs++;
+	spinlock_release(&vmalloc_spinlock);
+
+	return (void *)VMALLOC_ADDR(start);
+}
+
+void
+vfree(void *ptr)
+{
+	vaddr_t va = (vaddr_t)ptr;
+	uint32_t entry;
+	unsigned i;
+	int index;
+
+	KASSERT(vmalloc_contains(ptr));
+	KASSERT(va % PAGE_SIZE == 0);
+
+	for (i = VMALLOC_INDEX(va); ; i++) {
+		KASSERT(i < VMALLOC_PAGES);
+
+		spinlock_acquire(&vmalloc_spinlock);
+		entry = vmalloc_pt[i];
+		vmalloc_pt[i] = VMALLOC_STALE;
+		vmalloc_nstale++;
+		if (entry == VMALLOC_GUARD) {
+			vmalloc_areas--;
+			spinlock_release(&vmalloc_spinlock);
+			break;
+		}
+		if ((entry & TLBLO_VALID) == 0) {
+			panic("vfree: %p is not a vmalloc area\n", ptr);
+		}
+		vmalloc_inuse--;
+
+		/* other CPUs wait for the next purge */
+		index = tlb_probe(VMALLOC_ADDR(i), 0);
+		if (index >= 0) {
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),
+				  index);
+		}
+		tlb_setpid(curcpu->c_tlbpid);
+		spinlock_release(&vmalloc_spinlock);
+
+		free_kpages(PADDR_TO_KVADDR(entry & TLBLO_PPAGE));
+	}
+}
+
+bool
+vmalloc_contains(const void *ptr)
+{
+	vaddr_t va = (vaddr_t)ptr;
+
+	return va >= VMALLOC_BASE && va < VMALLOC_END;
+}
+
+int
+vmalloc_fault(int faulttype, vaddr_t faultaddress)
+{
+	vaddr_t page = faultaddress & PAGE_FRAME;
+	uint32_t entry;
+	int index;
+
+	if (vmalloc_pt == NULL || faultaddress >= VMALLOC_END ||
+	    faulttype == VM_FAULT_READONLY) {
+		return EFAULT;
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+	entry = vmalloc_pt[VMALLOC_INDEX(page)];
+	if ((entry & TLBLO_VALID) == 0) {
+		/* guard page, freed, or not allocated at all */
+		spinlock_release(&vmalloc_spinlock);
+		return EFAULT;
+	}
+	KASSERT(curcpu->c_number < 32);
+	vmalloc_cpus |= (uint32_t)1 << curcpu->c_number;
+	vmalloc_faults++;
+
+	/* global, so the pid doesn't matter */
+	index = tlb_probe(page, 0);
+	if (index >= 0) {
+		tlb_write(page, entry, index);
+	}
+	else {
+		tlb_random(page, entry);
+	}
+	tlb_setpid(curcpu->c_tlbpid);
+	spinlock_release(&vmalloc_spinlock);
+
+	return 0;
+}
+
+void
+vmalloc_printstats(void)
+{
+	spinlock_acquire(&vmalloc_spinlock);
+	kprintf("vmalloc: %u areas (%u pages) in use, %u allocated, "
+		"%u faults, %u purges, %u failures\n",
+		vmalloc_areas, vmalloc_inuse, vmalloc_allocs,
+		vmalloc_faults, vmalloc_purges, vmalloc_failures);
+	spinlock_release(&vmalloc_spinlock);
+}
@@ -43,6 +43,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/mman.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -169,5 +170,7 @@ time_t time(time_t *seconds);			/* calls __time */
 
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
+int madvise(void *addr, size_t len, int advice);
+int mincore(void *addr, size_t len, char *vec);
 
 #endif /* _UNISTD_H_ */